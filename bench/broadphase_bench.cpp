@@ -0,0 +1,617 @@
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <initializer_list>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "AABBTree.hpp"
+#include "WideBVH.hpp"
+#include "QuantizedBVH.hpp"
+#include "SpatialHashGrid.hpp"
+#include "SweepAndPrune.hpp"
+#include "HierarchicalGrid.hpp"
+#include "PhysicsWorld.hpp"
+
+// Not a unit test, run the Release build:
+// ./Bench
+
+namespace
+{
+    struct Scene
+    {
+        std::vector<sas::AABB> boxes;
+        float extent;
+    };
+
+    uint32_t seed = 1337;
+
+    float NextFloat()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    }
+
+    // Similar density for every body count
+    Scene MakeScene(size_t count)
+    {
+        Scene scene;
+        scene.extent = std::sqrt(static_cast<float>(count)) * 40.f;
+
+        scene.boxes.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            float x = NextFloat() * scene.extent;
+            float y = NextFloat() * scene.extent;
+            float half = 5.f + NextFloat() * 15.f;
+
+            scene.boxes.push_back({x - half, y - half, x + half, y + half});
+        }
+
+        return scene;
+    }
+
+    template <typename F>
+    double TimeMs(F &&work)
+    {
+        auto start = std::chrono::steady_clock::now();
+        work();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    void BenchQueryBackends(const Scene &scene)
+    {
+        sas::AABBTree tree;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            tree.insert(i, scene.boxes[i]);
+        }
+
+        sas::WideBVH wide;
+        double collapseMs = TimeMs([&]
+                                   { wide.Build(tree); });
+
+        size_t binaryHits = 0;
+        double binaryMs = TimeMs([&]
+                                 {
+                                     for (const auto &box : scene.boxes)
+                                         tree.QueryVisit(box, [&binaryHits](uint32_t)
+                                                         { ++binaryHits; }); });
+
+        size_t wideHits = 0;
+        double wideMs = TimeMs([&]
+                               {
+                                   for (const auto &box : scene.boxes)
+                                       wide.QueryVisit(box, [&wideHits](uint32_t)
+                                                       { ++wideHits; }); });
+
+        // Boxes were generated in random order, the batch wants neighbouring queries together
+        std::vector<sas::AABB> sorted = scene.boxes;
+        float cell = scene.extent / 64.f;
+        std::sort(sorted.begin(), sorted.end(), [cell](const sas::AABB &a, const sas::AABB &b)
+                  {
+                      auto key = [cell](const sas::AABB &box)
+                      { return std::make_pair(static_cast<int>(box.minY / cell), box.minX); };
+                      return key(a) < key(b); });
+
+        size_t sortedHits = 0;
+        double sortedMs = TimeMs([&]
+                                 {
+                                     for (const auto &box : sorted)
+                                         tree.QueryVisit(box, [&sortedHits](uint32_t)
+                                                         { ++sortedHits; }); });
+
+        size_t batchHits = 0;
+        double batchMs = TimeMs([&]
+                                { tree.QueryBatch(sorted, [&batchHits](size_t, uint32_t)
+                                                  { ++batchHits; }); });
+
+        std::printf("%8zu bodies | binary %8.2f ms | wide4 %8.2f ms (collapse %6.2f ms) | hits %zu/%zu\n",
+                    scene.boxes.size(), binaryMs, wideMs, collapseMs, binaryHits, wideHits);
+        std::printf("%8s        | sorted queries binary %8.2f ms, batch of 64 %8.2f ms | hits %zu/%zu\n",
+                    "", sortedMs, batchMs, sortedHits, batchHits);
+    }
+
+    void BenchBuild(const Scene &scene)
+    {
+        std::vector<sas::TreeProxy> proxies;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            proxies.emplace_back(i, scene.boxes[i]);
+        }
+
+        sas::AABBTree incremental;
+        double insertMs = TimeMs([&]
+                                 {
+                                     for (const auto &[id, box] : proxies)
+                                         incremental.insert(id, box); });
+
+        sas::AABBTree built;
+        double buildMs = TimeMs([&]
+                                { built.Build(proxies); });
+
+        sas::AABBTree lbvh;
+        double lbvhSerialMs = TimeMs([&]
+                                     { lbvh.BuildParallel(proxies, 1); });
+        double lbvhParallelMs = TimeMs([&]
+                                       { lbvh.BuildParallel(proxies); });
+
+        size_t incrementalHits = 0, builtHits = 0;
+        double incrementalQueryMs = TimeMs([&]
+                                           {
+                                               for (const auto &box : scene.boxes)
+                                                   incremental.QueryVisit(box, [&incrementalHits](uint32_t)
+                                                                          { ++incrementalHits; }); });
+        double builtQueryMs = TimeMs([&]
+                                     {
+                                         for (const auto &box : scene.boxes)
+                                             built.QueryVisit(box, [&builtHits](uint32_t)
+                                                              { ++builtHits; }); });
+
+        size_t lbvhHits = 0;
+        double lbvhQueryMs = TimeMs([&]
+                                    {
+                                        for (const auto &box : scene.boxes)
+                                            lbvh.QueryVisit(box, [&lbvhHits](uint32_t)
+                                                            { ++lbvhHits; }); });
+
+        std::printf("%8zu bodies | insert %8.2f ms, query %8.2f ms | SAH build %8.2f ms, query %8.2f ms | hits %zu/%zu\n",
+                    scene.boxes.size(), insertMs, incrementalQueryMs, buildMs, builtQueryMs, incrementalHits, builtHits);
+        std::printf("%8s        | LBVH 1 thread %8.2f ms, %u threads %8.2f ms, query %8.2f ms | hits %zu\n",
+                    "", lbvhSerialMs, std::max(1u, std::thread::hardware_concurrency()), lbvhParallelMs, lbvhQueryMs, lbvhHits);
+    }
+
+    void BenchQuantized(const Scene &scene)
+    {
+        sas::AABBTree tree;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            tree.insert(i, scene.boxes[i]);
+        }
+
+        sas::QuantizedBVH quantized;
+        double compressMs = TimeMs([&]
+                                   { quantized.Build(tree); });
+
+        sas::WideBVH wide;
+        wide.Build(tree);
+
+        size_t binaryHits = 0;
+        double binaryMs = TimeMs([&]
+                                 {
+                                     for (const auto &box : scene.boxes)
+                                         tree.QueryVisit(box, [&binaryHits](uint32_t)
+                                                         { ++binaryHits; }); });
+
+        size_t quantizedHits = 0;
+        double quantizedMs = TimeMs([&]
+                                    {
+                                        for (const auto &box : scene.boxes)
+                                            quantized.QueryVisit(box, [&quantizedHits](uint32_t)
+                                                                 { ++quantizedHits; }); });
+
+        double kb = 1.0 / 1024.0;
+        std::printf("%8zu bodies | binary %8.0f KB %8.2f ms | wide4 %8.0f KB | quantized %8.0f KB %8.2f ms (compress %6.2f ms) | hits %zu/%zu\n",
+                    scene.boxes.size(), tree.GetNodeCount() * sizeof(sas::Node) * kb, binaryMs,
+                    wide.GetNodeCount() * sizeof(sas::WideNode) * kb,
+                    quantized.GetMemoryUsage() * kb, quantizedMs, compressMs, binaryHits, quantizedHits);
+    }
+
+    // Every overlapping pair from scratch, the grid cell is about twice the average box
+    void BenchAllPairs(const Scene &scene)
+    {
+        sas::AABBTree tree;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            tree.insert(i, scene.boxes[i]);
+        }
+
+        std::vector<sas::BroadPair> treePairs;
+        double treeMs = TimeMs([&]
+                               { tree.FindAllPairs(treePairs); });
+
+        sas::SpatialHashGrid grid;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            grid.SetProxy(i, scene.boxes[i], sas::Flags::LayerAll | sas::Flags::MaskAll);
+        }
+
+        std::vector<sas::BroadPair> gridPairs;
+        double buildMs = TimeMs([&]
+                                { grid.Build(50.f); });
+        double gridMs = TimeMs([&]
+                               { grid.FindAllPairs(gridPairs); });
+
+        std::printf("%8zu bodies | tree %8.2f ms | grid build %8.2f ms, pairs %8.2f ms | pairs %zu/%zu\n",
+                    scene.boxes.size(), treeMs, buildMs, gridMs, treePairs.size(), gridPairs.size());
+    }
+
+    // Side scroller strip, long in x and short in y
+    Scene MakeStripScene(size_t count)
+    {
+        Scene scene;
+        scene.extent = static_cast<float>(count) * 4.f;
+
+        scene.boxes.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            float x = NextFloat() * scene.extent;
+            float y = NextFloat() * 300.f;
+            float half = 5.f + NextFloat() * 5.f;
+
+            scene.boxes.push_back({x - half, y - half, x + half, y + half});
+        }
+
+        return scene;
+    }
+
+    const char *BroadphaseName(sas::BroadphaseType broadphase)
+    {
+        switch (broadphase)
+        {
+        case sas::BroadphaseType::Tree:
+            return "tree";
+        case sas::BroadphaseType::Grid:
+            return "grid";
+        case sas::BroadphaseType::SweepAndPrune:
+            return "SAP";
+        case sas::BroadphaseType::HierarchicalGrid:
+            return "hgrid";
+        }
+
+        return "";
+    }
+
+    // Broadphase and query backend of one BenchWorldStep column
+    struct StepSetup
+    {
+        StepSetup(sas::BroadphaseType broadphaseType, sas::QueryBackend queryBackend = sas::QueryBackend::Binary)
+            : broadphase(broadphaseType), backend(queryBackend)
+        {
+        }
+
+        sas::BroadphaseType broadphase;
+        sas::QueryBackend backend;
+    };
+
+    const char *BackendName(sas::QueryBackend backend)
+    {
+        switch (backend)
+        {
+        case sas::QueryBackend::Binary:
+            return "";
+        case sas::QueryBackend::Wide4:
+            return " wide4";
+        case sas::QueryBackend::Quantized:
+            return " quantized";
+        }
+
+        return "";
+    }
+
+    // Mostly debris, some crates and one platform in a hundred
+    Scene MakeMixedScene(size_t count)
+    {
+        Scene scene;
+        scene.extent = std::sqrt(static_cast<float>(count)) * 25.f;
+
+        scene.boxes.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            float x = NextFloat() * scene.extent;
+            float y = NextFloat() * scene.extent;
+
+            if (i % 100 == 0)
+            {
+                scene.boxes.push_back({x - 400.f, y - 8.f, x + 400.f, y + 8.f});
+                continue;
+            }
+
+            float half = i % 10 == 0 ? 10.f + NextFloat() * 20.f : 2.f + NextFloat() * 3.f;
+            scene.boxes.push_back({x - half, y - half, x + half, y + half});
+        }
+
+        return scene;
+    }
+
+    // Every overlapping pair from scratch, the uniform grid's cell is sized for the debris
+    void BenchMixedSizes(const Scene &scene)
+    {
+        sas::AABBTree tree;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            tree.insert(i, scene.boxes[i]);
+        }
+
+        std::vector<sas::BroadPair> treePairs;
+        double treeMs = TimeMs([&]
+                               { tree.FindAllPairs(treePairs); });
+
+        sas::SpatialHashGrid grid;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            grid.SetProxy(i, scene.boxes[i], sas::Flags::LayerAll | sas::Flags::MaskAll);
+        }
+
+        std::vector<sas::BroadPair> gridPairs;
+        double gridMs = TimeMs([&]
+                               {
+                                   grid.Build(16.f);
+                                   grid.FindAllPairs(gridPairs); });
+
+        sas::HierarchicalGrid hierarchical;
+        for (uint32_t i = 0; i < scene.boxes.size(); ++i)
+        {
+            hierarchical.SetProxy(i, scene.boxes[i], sas::Flags::LayerAll | sas::Flags::MaskAll);
+        }
+
+        std::vector<sas::BroadPair> hierarchicalPairs;
+        double hierarchicalMs = TimeMs([&]
+                                       {
+                                           hierarchical.Build(8.f);
+                                           hierarchical.FindAllPairs(hierarchicalPairs); });
+
+        std::printf("%8zu bodies | tree %8.2f ms | grid %8.2f ms (%zu entries) | hierarchical grid %8.2f ms | pairs %zu/%zu/%zu\n",
+                    scene.boxes.size(), treeMs, gridMs, grid.GetEntryCount(), hierarchicalMs,
+                    treePairs.size(), gridPairs.size(), hierarchicalPairs.size());
+    }
+
+    // Whole Steps of a world of bodies made from the scene's boxes, long ones become platforms
+    // Unlike the all pairs runs this counts the upkeep of each broadphase, and the same narrowphase for all of them
+    // Slow bodies stay in their fat boxes for many frames, fast ones leave them about every frame
+    void BenchWorldStep(const Scene &scene, float speed, std::initializer_list<StepSetup> setups)
+    {
+        constexpr int Frames = 20;
+        constexpr float Dt = 1.f / 60.f;
+
+        std::vector<sas::BodyDef> defs;
+        defs.reserve(scene.boxes.size());
+        for (const auto &box : scene.boxes)
+        {
+            float halfX = (box.maxX - box.minX) * 0.5f;
+            float halfY = (box.maxY - box.minY) * 0.5f;
+
+            sas::BodyDef def{halfX > halfY ? sas::Shape::MakeBox(halfX, halfY) : sas::Shape::MakeCircle(halfX), {}};
+            def.transform.position = {box.minX + halfX, box.minY + halfY};
+            def.kinematics.inverseMass = 1.f;
+            def.kinematics.velocity = {(NextFloat() - 0.5f) * speed, (NextFloat() - 0.5f) * speed};
+
+            defs.push_back(def);
+        }
+
+        auto run = [&scene, &defs](const StepSetup &setup, size_t &contacts)
+        {
+            sas::PhysicsWorld world({0, 0, scene.extent, scene.extent}, setup.backend);
+            world.settings.gravity = 0.f;
+            world.settings.dragCoeff = 0.f;
+            world.settings.broadphase = setup.broadphase;
+
+            world.CreateBodies(defs);
+
+            // Pairs everything once
+            world.Step(Dt);
+
+            contacts = 0;
+            double ms = TimeMs([&]
+                               {
+                                   for (int frame = 0; frame < Frames; ++frame)
+                                   {
+                                       world.Step(Dt);
+                                       contacts += world.contacts.size();
+                                   } });
+
+            return ms / Frames;
+        };
+
+        std::printf("%8zu bodies", scene.boxes.size());
+
+        std::vector<size_t> contacts;
+        for (const StepSetup &setup : setups)
+        {
+            contacts.push_back(0);
+            double ms = run(setup, contacts.back());
+            std::printf(" | %s%s %8.2f ms", BroadphaseName(setup.broadphase), BackendName(setup.backend), ms);
+        }
+
+        std::printf(" | contacts");
+        for (size_t i = 0; i < contacts.size(); ++i)
+            std::printf("%c%zu", i ? '/' : ' ', contacts[i]);
+        std::printf("\n");
+    }
+
+    // Side scroller strip, long in x and short in y, every body drifts a little each frame
+    // Both sides keep their own fat boxes with the same rule, the upkeep and the pair finding are timed
+    void BenchSweepAndPrune(size_t count)
+    {
+        constexpr int Frames = 20;
+        const float length = static_cast<float>(count) * 4.f;
+
+        std::vector<sas::math::Vec2> centers(count);
+        std::vector<sas::math::Vec2> velocities(count);
+        std::vector<sas::AABB> tight(count), fat(count);
+
+        sas::AABBTree tree;
+        sas::SweepAndPrune sap;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            centers[i] = {NextFloat() * length, NextFloat() * 300.f};
+            velocities[i] = {(NextFloat() - 0.5f) * 4.f, (NextFloat() - 0.5f) * 4.f};
+
+            fat[i] = {centers[i].x - 8.f, centers[i].y - 8.f, centers[i].x + 8.f, centers[i].y + 8.f};
+            tree.insert(i, fat[i]);
+            sap.SetProxy(i, fat[i], sas::Flags::LayerAll | sas::Flags::MaskAll);
+        }
+
+        sap.Update();
+        tree.ClearMoveBuffer();
+
+        double treeMs = 0, sapMs = 0;
+        size_t treePairs = 0, sapPairs = 0, swaps = 0, events = 0;
+        std::vector<sas::BroadPair> pairs;
+
+        for (int frame = 0; frame < Frames; ++frame)
+        {
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                centers[i] = centers[i] + velocities[i];
+                tight[i] = {centers[i].x - 8.f, centers[i].y - 8.f, centers[i].x + 8.f, centers[i].y + 8.f};
+            }
+
+            pairs.clear();
+            treeMs += TimeMs([&]
+                             {
+                                 for (uint32_t i = 0; i < count; ++i)
+                                     tree.UpdateObject(i, tight[i], sas::ComputeSweptAABB(tight[i], velocities[i] * 3.f, 2.f));
+
+                                 tree.FindAllPairs(pairs); });
+            sapMs += TimeMs([&]
+                            {
+                                for (uint32_t i = 0; i < count; ++i)
+                                {
+                                    if (sas::AABBContains(fat[i], tight[i]))
+                                        continue;
+
+                                    fat[i] = sas::ComputeSweptAABB(tight[i], velocities[i] * 3.f, 2.f);
+                                    sap.SetProxy(i, fat[i], sas::Flags::LayerAll | sas::Flags::MaskAll);
+                                }
+
+                                sap.Update(); });
+            tree.ClearMoveBuffer();
+
+            treePairs += pairs.size();
+            sapPairs += sap.GetPairCount();
+            swaps += sap.GetSwapCount();
+            events += sap.GetAddedPairs().size() + sap.GetRemovedPairs().size();
+        }
+
+        std::printf("%8zu bodies | tree update and pairs %8.2f ms | SAP update %8.2f ms, %6zu swaps %6zu events per frame | pairs %zu/%zu\n",
+                    count, treeMs / Frames, sapMs / Frames, swaps / Frames, events / Frames, treePairs, sapPairs);
+    }
+
+    // Sensor style fans of rays from random agents, one body per scene box
+    void BenchRayCast(const Scene &scene)
+    {
+        sas::PhysicsWorld world({0, 0, scene.extent, scene.extent});
+
+        std::vector<sas::BodyDef> defs;
+        defs.reserve(scene.boxes.size());
+        for (const auto &box : scene.boxes)
+        {
+            float half = (box.maxX - box.minX) * 0.5f;
+
+            sas::Transform trans{};
+            trans.position = {box.minX + half, box.minY + half};
+
+            defs.push_back({sas::Shape::MakeCircle(half), trans});
+        }
+        world.CreateBodies(defs);
+
+        constexpr int RaysPerAgent = 8;
+        const size_t agents = scene.boxes.size() / 10;
+
+        std::vector<sas::Ray> rays;
+        rays.reserve(agents * RaysPerAgent);
+        for (size_t i = 0; i < agents; ++i)
+        {
+            sas::math::Vec2 origin{NextFloat() * scene.extent, NextFloat() * scene.extent};
+
+            for (int r = 0; r < RaysPerAgent; ++r)
+            {
+                float angle = 6.2831853f * static_cast<float>(r) / RaysPerAgent;
+                rays.push_back({origin, {std::cos(angle) * 300.f, std::sin(angle) * 300.f}});
+            }
+        }
+
+        std::vector<sas::RayHit> singleHits(rays.size());
+        double singleMs = TimeMs([&]
+                                 {
+                                     for (size_t i = 0; i < rays.size(); ++i)
+                                         singleHits[i] = world.RayCast(rays[i]); });
+
+        std::vector<sas::RayHit> batchHits(rays.size());
+        double batchMs = TimeMs([&]
+                                { world.RayCastBatch(rays, batchHits); });
+
+        size_t singleCount = std::count_if(singleHits.begin(), singleHits.end(), [](const sas::RayHit &hit)
+                                           { return hit.hit; });
+        size_t batchCount = std::count_if(batchHits.begin(), batchHits.end(), [](const sas::RayHit &hit)
+                                          { return hit.hit; });
+
+        std::printf("%8zu bodies | %7zu rays | single %8.2f ms | batch %8.2f ms | hits %zu/%zu\n",
+                    scene.boxes.size(), rays.size(), singleMs, batchMs, singleCount, batchCount);
+    }
+} // namespace
+
+int main()
+{
+    const size_t counts[] = {10000, 50000, 100000};
+
+    std::printf("Query backends, one query per body\n");
+    for (size_t count : counts)
+    {
+        BenchQueryBackends(MakeScene(count));
+    }
+
+    std::printf("\nIncremental inserts vs bulk builds\n");
+    for (size_t count : counts)
+    {
+        BenchBuild(MakeScene(count));
+    }
+
+    std::printf("\nNode memory and query time of the compressed tree\n");
+    for (size_t count : counts)
+    {
+        BenchQuantized(MakeScene(count));
+    }
+
+    std::printf("\nAll pairs, tree vs spatial hash grid\n");
+    for (size_t count : counts)
+    {
+        BenchAllPairs(MakeScene(count));
+    }
+
+    std::printf("\nPersistent sweep and prune on a side scroller strip, per frame\n");
+    for (size_t count : counts)
+    {
+        BenchSweepAndPrune(count);
+    }
+
+    std::printf("\nAll pairs on a scene of debris, crates and platforms, build included\n");
+    for (size_t count : counts)
+    {
+        BenchMixedSizes(MakeMixedScene(count));
+    }
+
+    for (float speed : {40.f, 1200.f})
+    {
+        std::printf("\nPhysicsWorld::Step per frame, similar sized circles, speed up to %.0f\n", speed / 2.f);
+        for (size_t count : counts)
+        {
+            BenchWorldStep(MakeScene(count), speed,
+                           {sas::BroadphaseType::Tree, {sas::BroadphaseType::Tree, sas::QueryBackend::Wide4},
+                            {sas::BroadphaseType::Tree, sas::QueryBackend::Quantized}, sas::BroadphaseType::Grid});
+        }
+
+        std::printf("\nPhysicsWorld::Step per frame, debris, crates and platforms, speed up to %.0f\n", speed / 2.f);
+        for (size_t count : counts)
+        {
+            BenchWorldStep(MakeMixedScene(count), speed,
+                           {sas::BroadphaseType::Tree, sas::BroadphaseType::Grid, sas::BroadphaseType::HierarchicalGrid});
+        }
+
+        std::printf("\nPhysicsWorld::Step per frame, side scroller strip, speed up to %.0f\n", speed / 2.f);
+        for (size_t count : counts)
+        {
+            BenchWorldStep(MakeStripScene(count), speed, {sas::BroadphaseType::Tree, sas::BroadphaseType::SweepAndPrune});
+        }
+    }
+
+    std::printf("\nSingle raycasts vs packets of 4\n");
+    for (size_t count : counts)
+    {
+        BenchRayCast(MakeScene(count));
+    }
+}
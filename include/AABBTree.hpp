@@ -1,8 +1,18 @@
 #pragma once
 
-#include <unordered_map>
 #include <vector>
 #include <functional>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <span>
+#include <utility>
+#include <bit>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 #include "Body.hpp"
 
@@ -16,58 +26,803 @@ namespace sas
 
     AABB ComputeFatAABB(const Body &body, float margin = 10.f) noexcept;
 
-    bool AABBOverlap(const AABB &a, const AABB &b) noexcept;
+    // tight grown by margin on every side and stretched by displacement on the sides it points to
+    AABB ComputeSweptAABB(const AABB &tight, math::Vec2 displacement, float margin) noexcept;
+
+    // Inline so tree traversals can be fully inlined
+    inline bool AABBOverlap(const AABB &a, const AABB &b) noexcept
+    {
+        return (a.minX <= b.maxX && a.maxX >= b.minX) &&
+               (a.minY <= b.maxY && a.maxY >= b.minY);
+    }
+
+    // inner lies completely inside outer, edges included
+    inline bool AABBContains(const AABB &outer, const AABB &inner) noexcept
+    {
+        return inner.minX >= outer.minX && inner.maxX <= outer.maxX &&
+               inner.minY >= outer.minY && inner.maxY <= outer.maxY;
+    }
+
+    // Body::collisionMask layout, layers in the low half and the layers it hits in the high half
+    // Also exact for the OR of several masks in the sense that false means no pair of them can collide
+    inline bool CanCollide(uint32_t a, uint32_t b) noexcept
+    {
+        return ((a >> 16) & b & Flags::LayerAll) && ((b >> 16) & a & Flags::LayerAll);
+    }
 
     AABB AABBUnion(const AABB &a, const AABB &b) noexcept;
     AABB ComputeTightAABB(const Body &body) noexcept;
 
     float GetAreaAABB(const AABB &a) noexcept;
 
+    // Candidate pair from the broadphase, bodyA < bodyB
+    struct BroadPair
+    {
+        uint32_t bodyA;
+        uint32_t bodyB;
+
+        auto operator<=>(const BroadPair &) const = default;
+    };
+
+    // Segment origin -> origin + translation * maxFraction
+    struct RayCastInput
+    {
+        math::Vec2 origin;
+        math::Vec2 translation;
+        float maxFraction = 1.f;
+    };
+
+    // Slab test of the segment against a box
+    inline bool RayOverlapsAABB(const math::Vec2 &origin, const math::Vec2 &translation, float maxFraction, const AABB &box) noexcept
+    {
+        float tMin = 0.f;
+        float tMax = maxFraction;
+
+        const float lower[2] = {box.minX, box.minY};
+        const float upper[2] = {box.maxX, box.maxY};
+
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            float o = origin.data[axis];
+            float d = translation.data[axis];
+
+            // Parallel to the slab
+            if (std::abs(d) < 1e-12f)
+            {
+                if (o < lower[axis] || o > upper[axis])
+                    return false;
+
+                continue;
+            }
+
+            float inv = 1.f / d;
+            float t1 = (lower[axis] - o) * inv;
+            float t2 = (upper[axis] - o) * inv;
+
+            tMin = std::max(tMin, std::min(t1, t2));
+            tMax = std::min(tMax, std::max(t1, t2));
+
+            if (tMin > tMax)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Four segments stored SoA so one box is slab tested against all of them at once
+    struct alignas(16) RayPacket
+    {
+        float originX[4], originY[4];
+        // Reciprocal translation, axis aligned rays use a huge finite value so no lane turns NaN
+        float invDirX[4], invDirY[4];
+        // Negative for unused lanes
+        float maxFraction[4];
+
+        void SetLane(int lane, const math::Vec2 &origin, const math::Vec2 &translation, float fraction) noexcept
+        {
+            constexpr float MinDir = 1e-12f;
+
+            float dx = std::abs(translation.x) < MinDir ? std::copysign(MinDir, translation.x) : translation.x;
+            float dy = std::abs(translation.y) < MinDir ? std::copysign(MinDir, translation.y) : translation.y;
+
+            originX[lane] = origin.x;
+            originY[lane] = origin.y;
+            invDirX[lane] = 1.f / dx;
+            invDirY[lane] = 1.f / dy;
+            maxFraction[lane] = fraction;
+        }
+
+        void ClearLane(int lane) noexcept
+        {
+            SetLane(lane, {}, {1.f, 1.f}, -1.f);
+        }
+    };
+
+    // Bit i is set when lane i crosses box
+    inline int RayPacketMask(const RayPacket &packet, const AABB &box) noexcept
+    {
+#if defined(__SSE__)
+        __m128 ox = _mm_load_ps(packet.originX);
+        __m128 oy = _mm_load_ps(packet.originY);
+        __m128 ix = _mm_load_ps(packet.invDirX);
+        __m128 iy = _mm_load_ps(packet.invDirY);
+
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minX), ox), ix);
+        __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxX), ox), ix);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minY), oy), iy);
+        __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxY), oy), iy);
+
+        __m128 tMin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_setzero_ps());
+        __m128 tMax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_load_ps(packet.maxFraction));
+
+        return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            float tx1 = (box.minX - packet.originX[i]) * packet.invDirX[i];
+            float tx2 = (box.maxX - packet.originX[i]) * packet.invDirX[i];
+            float ty1 = (box.minY - packet.originY[i]) * packet.invDirY[i];
+            float ty2 = (box.maxY - packet.originY[i]) * packet.invDirY[i];
+
+            float tMin = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), 0.f);
+            float tMax = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), packet.maxFraction[i]);
+
+            if (tMin <= tMax)
+                mask |= 1 << i;
+        }
+
+        return mask;
+#endif
+    }
+
+    // Squared distance from p to the closest point of box, 0 inside
+    inline float PointAABBDistanceSq(const math::Vec2 &p, const AABB &box) noexcept
+    {
+        float dx = std::max(std::max(box.minX - p.x, p.x - box.maxX), 0.f);
+        float dy = std::max(std::max(box.minY - p.y, p.y - box.maxY), 0.f);
+
+        return dx * dx + dy * dy;
+    }
+
+    struct NearestResult
+    {
+        uint32_t bodyID;
+        float distance;
+    };
+
+    // Body id and the fat box it is stored with
+    using TreeProxy = std::pair<uint32_t, AABB>;
+
     using DrawCallback = std::function<void(const AABB&, bool isLeaf)>;
-    
+
+    inline constexpr uint32_t NullNode = std::numeric_limits<uint32_t>::max();
+
+    // Depth first traversals keep at most height + 1 nodes pending
+    inline constexpr int QueryStackSize = 256;
+
+    // Pending nodes of a nearest query, subtrees that do not fit are searched depth first
+    inline constexpr int NearestHeapSize = 128;
+
+    // Nodes live in AABBTree's pool and link to each other by index
     struct Node
     {
         AABB aabb;
 
-        Node *parent = nullptr;
-        Node *children[2] = {nullptr, nullptr};
+        // Free nodes reuse the parent slot as the free list link
+        union
+        {
+            uint32_t parent = NullNode;
+            uint32_t next;
+        };
+        uint32_t children[2] = {NullNode, NullNode};
 
         int objectID = -1;
 
+        // Body::collisionMask of a leaf, OR of the leaves below an internal node
+        uint32_t collisionMask = Flags::LayerAll | Flags::MaskAll;
+
+        // Leaf = 0, free node = -1
+        int height = 0;
+
         bool isLeaf() const noexcept
         {
-            return children[0] == nullptr;
+            return children[0] == NullNode;
         }
+    };
 
-        void Draw(const DrawCallback& cb) const;
+    enum struct InsertStrategy
+    {
+        // Surface area heuristic search over the whole tree, pruned by a lower bound
+        BranchAndBound,
+        // Single descent that only looks at the two children
+        Greedy
+    };
+
+    enum struct UpdateMode
+    {
+        // remove + insert whenever the body escapes its fat box
+        Reinsert,
+        // Always resize the leaf in place and refit the ancestors
+        Refit,
+        // Refit while the fat box grows by at most refitGrowthLimit, reinsert otherwise
+        Adaptive
+    };
+
+    struct UpdateStats
+    {
+        uint32_t refits = 0;
+        uint32_t reinserts = 0;
+        // Subtrees moved by Optimize
+        uint32_t optimized = 0;
     };
 
     class AABBTree
     {
+        // Read the nodes directly to compress them
+        friend class WideBVH;
+        friend class QuantizedBVH;
+
     private:
-        Node *root = nullptr;
-        std::unordered_map<uint32_t, Node *> leafMap;
-        void Clear(Node *node) noexcept;
-        void remove(Node *leaf) noexcept;
-        
+        struct BuildProxy
+        {
+            uint32_t id;
+            AABB aabb;
+            float centerX, centerY;
+        };
+
+        struct SiblingCandidate
+        {
+            uint32_t node;
+            float inheritedCost;
+        };
+
+        struct OptimizeCandidate
+        {
+            uint32_t node;
+            double cost;
+        };
+
+        uint32_t root = NullNode;
+        InsertStrategy strategy;
+
+        UpdateMode updateMode = UpdateMode::Adaptive;
+        // Relative area growth of the fat box
+        float refitGrowthLimit = 0.5f;
+        UpdateStats updateStats;
+
+        std::vector<Node> nodes;
+        uint32_t freeList = NullNode;
+
+        // Leaf node of every body, indexed by body id, NullNode when absent
+        // Body ids are small and recycled, so this stays dense
+        std::vector<uint32_t> leafMap;
+
+        // Body::collisionMask by body id, kept across removal and rebuilds
+        std::vector<uint32_t> collisionMasks;
+
+        // Bodies whose fat box changed since the last ClearMoveBuffer
+        std::vector<uint32_t> moveBuffer;
+
+        // Reused by every insert, so the search does not allocate
+        std::vector<SiblingCandidate> siblingHeap;
+
+        // Optimize looks at a window of the pool starting here, so every node is looked at in turn
+        uint32_t optimizeCursor = 0;
+        std::vector<OptimizeCandidate> optimizeCandidates;
+
+        [[nodiscard]] uint32_t AllocateNode() noexcept;
+        void FreeNode(uint32_t node) noexcept;
+        void SetLeaf(uint32_t bodyID, uint32_t leaf) noexcept;
+        [[nodiscard]] uint32_t GetCollisionMask(uint32_t bodyID) const noexcept;
+
+        // AVL style rotation, returns the new root of the subtree
+        [[nodiscard]] uint32_t Balance(uint32_t node) noexcept;
+        void RefitAncestors(uint32_t node) noexcept;
+
+        // Hangs a detached subtree, a single leaf included, next to the best sibling
+        void InsertSubtree(uint32_t node, InsertStrategy search) noexcept;
+
+        [[nodiscard]] uint32_t FindSiblingGreedy(const AABB &aabb) const noexcept;
+        [[nodiscard]] uint32_t FindSiblingBranchAndBound(const AABB &aabb) noexcept;
+
+        uint32_t BuildRange(BuildProxy *begin, BuildProxy *end) noexcept;
+
+        void SelfPairs(uint32_t node, std::vector<BroadPair> &pairs) const noexcept;
+        void CrossPairs(uint32_t nodeA, uint32_t nodeB, std::vector<BroadPair> &pairs) const noexcept;
+
+        template <typename F>
+        static bool Visit(F &visitor, uint32_t bodyID) noexcept;
+
+        // Depth first walk into every node that passes test(node), calls visitor on the leaves
+        template <typename Test, typename F>
+        void Traverse(const Test &test, F &visitor) const noexcept;
+
+        // Walks the parent links instead of a stack, only for trees too deep for QueryStackSize
+        template <typename Test, typename F>
+        void TraverseStackless(const Test &test, F &visitor) const noexcept;
+
+        // Closest first entry of the QueryNearest heap
+        struct NearestEntry
+        {
+            float distanceSq;
+            uint32_t node;
+
+            bool operator>(const NearestEntry &other) const noexcept
+            {
+                return distanceSq > other.distanceSq;
+            }
+        };
+
+        template <typename F>
+        void NearestVisitLeaf(uint32_t bodyID, F &distance, std::span<NearestResult> results, size_t &count, float &bound) const noexcept;
+
+        template <typename F>
+        void NearestDepthFirst(uint32_t node, const math::Vec2 &point, F &distance, std::span<NearestResult> results, size_t &count, float &bound) const noexcept;
+
+        void removeLeaf(uint32_t leaf) noexcept;
+        void Draw(uint32_t node, const DrawCallback& cb) const;
+
     public:
+        explicit AABBTree(InsertStrategy insertStrategy = InsertStrategy::BranchAndBound) noexcept
+            : strategy(insertStrategy)
+        {
+        }
+
+        void SetInsertStrategy(InsertStrategy insertStrategy) noexcept
+        {
+            strategy = insertStrategy;
+        }
+
+        [[nodiscard]] InsertStrategy GetInsertStrategy() const noexcept
+        {
+            return strategy;
+        }
+
         void insert(uint32_t bodyID, const AABB& aabb) noexcept;
 
+        // Layer bits the tree prunes with, bodies never given one match everything
+        // Can be called before the body is inserted, a body already in the tree gets re-paired
+        void SetCollisionMask(uint32_t bodyID, uint32_t collisionMask) noexcept;
+
+        // Replaces the whole tree with a top down binned SAH build
+        // Much faster and tighter than inserting the proxies one by one
+        // markMoved = false when the proxies kept their boxes, e.g. a rebuild of the same bodies
+        void Build(std::span<const TreeProxy> proxies, bool markMoved = true) noexcept;
+
+        // Replaces the whole tree with a linear BVH built on threadCount threads (0 = all cores)
+        // Morton ordered, so faster to build than Build but slightly looser
+        void BuildParallel(std::span<const TreeProxy> proxies, uint32_t threadCount = 0, bool markMoved = true) noexcept;
+
+        // Appends every leaf currently in the tree
+        void GetProxies(std::vector<TreeProxy> &proxies) const;
+
         void Query(const AABB &targetAABB, std::vector<uint32_t> &results) const noexcept;
-        void Query(Node *node, const AABB &targetAABB, std::vector<uint32_t> &results) const noexcept;
+
+        // Calls visitor(bodyID) for every leaf overlapping aabb
+        // A visitor returning bool can stop the query early by returning false
+        template <typename F>
+        void QueryVisit(const AABB &aabb, F &&visitor) const noexcept;
+
+        // QueryVisit that skips every subtree with no body that can collide with collisionMask
+        template <typename F>
+        void QueryVisit(const AABB &aabb, uint32_t collisionMask, F &&visitor) const noexcept;
+
+        // Calls callback(queryIndex, bodyID) for every leaf overlapping queries[queryIndex]
+        // Up to 64 queries share one traversal, so the upper levels are only visited once per group
+        // Works best when neighbouring queries are close to each other
+        template <typename F>
+        void QueryBatch(std::span<const AABB> queries, F &&callback) const noexcept;
+
+        // Calls callback(input, bodyID) for every leaf whose box the segment crosses, closest hit style:
+        // return the fraction of a hit to clip the segment, input.maxFraction to ignore the body, 0 to stop
+        template <typename F>
+        void RayCast(const RayCastInput &input, F &&callback) const noexcept;
+
+        // RayCast for up to four segments sharing one traversal
+        // callback(lane, bodyID) returns the new max fraction of that lane
+        template <typename F>
+        void RayCastPacket(RayPacket &packet, F &&callback) const noexcept;
+
+        // Up to k = results.size() closest bodies within maxDist, sorted by distance, returns how many were found
+        // distance(bodyID) is the exact distance to the body, negative to skip it
+        // count > 0 continues from results[0, count) found before, e.g. in another tree
+        // Best first over a fixed size heap, never allocates
+        template <typename F>
+        size_t QueryNearest(const math::Vec2 &point, float maxDist, std::span<NearestResult> results, F &&distance, size_t count = 0) const noexcept;
+
+        // Appends every pair of overlapping leaves that CanCollide exactly once
+        void FindAllPairs(std::vector<BroadPair> &pairs) const noexcept;
 
         void remove(uint32_t id) noexcept;
 
+        [[nodiscard]] bool Contains(uint32_t id) const noexcept;
+        // id has to be in the tree
+        [[nodiscard]] const AABB &GetFatAABB(uint32_t id) const noexcept;
+
+        // May hold duplicates and ids that were removed since
+        [[nodiscard]] const std::vector<uint32_t> &GetMoveBuffer() const noexcept
+        {
+            return moveBuffer;
+        }
+
+        void ClearMoveBuffer() noexcept
+        {
+            moveBuffer.clear();
+        }
+
         void UpdateObject(const Body &body, float margin = 0.f) noexcept;
 
+        // Same, with a fat box the caller computed, tight is the body's current ComputeTightAABB
+        // Nothing happens while tight stays inside the stored box, fat has to contain tight
+        void UpdateObject(uint32_t bodyID, const AABB &tight, const AABB &fat) noexcept;
+
+        // Incremental optimization after Bittner et al.
+        // Takes up to nodeBudget of the worst placed internal nodes, removes them and reinserts their two children
+        // The leaves keep their boxes, so the pairs and the move buffer are not touched
+        void Optimize(uint32_t nodeBudget) noexcept;
+
+        // Sum of the internal node areas over the root area, the expected number of internal nodes a random query opens
+        [[nodiscard]] float GetSAHCost() const noexcept;
+
+        void SetUpdateMode(UpdateMode mode, float growthLimit = 0.5f) noexcept
+        {
+            updateMode = mode;
+            refitGrowthLimit = growthLimit;
+        }
+
+        [[nodiscard]] const UpdateStats &GetUpdateStats() const noexcept
+        {
+            return updateStats;
+        }
+
+        void ResetUpdateStats() noexcept
+        {
+            updateStats = {};
+        }
+
         void Draw(const DrawCallback& cb) const;
 
-        void Clear() noexcept;
-        
-        ~AABBTree() noexcept
+        // Pool size, free nodes included
+        [[nodiscard]] size_t GetNodeCount() const noexcept
         {
-            Clear(root);
+            return nodes.size();
         }
+
+        // Tree quality stats
+        [[nodiscard]] int GetHeight() const noexcept;
+        [[nodiscard]] int GetMaxBalance() const noexcept;
+
+        // Keeps the pool capacity, so refilling the tree does not allocate
+        void Clear() noexcept;
     };
 
+    template <typename F>
+    bool AABBTree::Visit(F &visitor, uint32_t bodyID) noexcept
+    {
+        if constexpr (std::is_void_v<std::invoke_result_t<F &, uint32_t>>)
+        {
+            visitor(bodyID);
+            return true;
+        }
+        else
+        {
+            return visitor(bodyID);
+        }
+    }
+
+    template <typename F>
+    void AABBTree::QueryVisit(const AABB &aabb, F &&visitor) const noexcept
+    {
+        auto test = [&aabb](const Node &node)
+        {
+            return AABBOverlap(node.aabb, aabb);
+        };
+
+        Traverse(test, visitor);
+    }
+
+    template <typename F>
+    void AABBTree::QueryVisit(const AABB &aabb, uint32_t collisionMask, F &&visitor) const noexcept
+    {
+        auto test = [&aabb, collisionMask](const Node &node)
+        {
+            return AABBOverlap(node.aabb, aabb) && CanCollide(collisionMask, node.collisionMask);
+        };
+
+        Traverse(test, visitor);
+    }
+
+    template <typename F>
+    void AABBTree::QueryBatch(std::span<const AABB> queries, F &&callback) const noexcept
+    {
+        if (root == NullNode)
+            return;
+
+        if (nodes[root].height >= QueryStackSize - 1)
+        {
+            for (size_t i = 0; i < queries.size(); ++i)
+            {
+                QueryVisit(queries[i], [&callback, i](uint32_t bodyID)
+                           { callback(i, bodyID); });
+            }
+            return;
+        }
+
+        struct Entry
+        {
+            uint32_t node;
+            // Queries of the group that overlap the node's parent
+            uint64_t active;
+        };
+
+        for (size_t first = 0; first < queries.size(); first += 64)
+        {
+            const AABB *group = queries.data() + first;
+            size_t count = std::min<size_t>(64, queries.size() - first);
+
+            Entry stack[QueryStackSize];
+            int top = 0;
+            stack[top++] = {root, count == 64 ? ~0ull : (1ull << count) - 1};
+
+            while (top > 0)
+            {
+                Entry entry = stack[--top];
+                const Node &node = nodes[entry.node];
+
+                uint64_t overlapping = 0;
+                for (uint64_t mask = entry.active; mask; mask &= mask - 1)
+                {
+                    int i = std::countr_zero(mask);
+                    if (AABBOverlap(node.aabb, group[i]))
+                        overlapping |= 1ull << i;
+                }
+
+                if (!overlapping)
+                    continue;
+
+                if (node.isLeaf())
+                {
+                    for (; overlapping; overlapping &= overlapping - 1)
+                    {
+                        callback(first + std::countr_zero(overlapping), static_cast<uint32_t>(node.objectID));
+                    }
+                }
+                else
+                {
+                    stack[top++] = {node.children[1], overlapping};
+                    stack[top++] = {node.children[0], overlapping};
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    void AABBTree::RayCast(const RayCastInput &input, F &&callback) const noexcept
+    {
+        RayCastInput clipped = input;
+
+        auto test = [&clipped](const Node &node)
+        {
+            return RayOverlapsAABB(clipped.origin, clipped.translation, clipped.maxFraction, node.aabb);
+        };
+
+        auto visitor = [&clipped, &callback](uint32_t bodyID)
+        {
+            float fraction = callback(static_cast<const RayCastInput &>(clipped), bodyID);
+
+            if (fraction <= 0.f)
+                return false;
+
+            clipped.maxFraction = std::min(clipped.maxFraction, fraction);
+            return true;
+        };
+
+        Traverse(test, visitor);
+    }
+
+    template <typename F>
+    void AABBTree::RayCastPacket(RayPacket &packet, F &&callback) const noexcept
+    {
+        // Both traversals visit a leaf right after testing it, so this is the leaf's mask
+        int lanes = 0;
+
+        auto test = [&packet, &lanes](const Node &node)
+        {
+            lanes = RayPacketMask(packet, node.aabb);
+            return lanes != 0;
+        };
+
+        auto visitor = [&packet, &lanes, &callback](uint32_t bodyID)
+        {
+            int mask = lanes;
+            while (mask)
+            {
+                int lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                packet.maxFraction[lane] = std::min(packet.maxFraction[lane], callback(lane, bodyID));
+            }
+        };
+
+        Traverse(test, visitor);
+    }
+
+    template <typename F>
+    size_t AABBTree::QueryNearest(const math::Vec2 &point, float maxDist, std::span<NearestResult> results, F &&distance, size_t count) const noexcept
+    {
+        if (root == NullNode || results.empty())
+            return count;
+
+        // Distance of the farthest body that would still make it into results
+        float bound = count == results.size() ? std::min(maxDist, results[count - 1].distance) : maxDist;
+
+        NearestEntry heap[NearestHeapSize];
+        int size = 0;
+
+        heap[size++] = {PointAABBDistanceSq(point, nodes[root].aabb), root};
+
+        while (size > 0)
+        {
+            std::pop_heap(heap, heap + size, std::greater<>{});
+            NearestEntry entry = heap[--size];
+
+            // Everything left is farther away
+            if (entry.distanceSq > bound * bound)
+                break;
+
+            const Node &node = nodes[entry.node];
+
+            if (node.isLeaf())
+            {
+                NearestVisitLeaf(static_cast<uint32_t>(node.objectID), distance, results, count, bound);
+                continue;
+            }
+
+            for (uint32_t child : node.children)
+            {
+                float childDistanceSq = PointAABBDistanceSq(point, nodes[child].aabb);
+
+                if (childDistanceSq > bound * bound)
+                    continue;
+
+                if (size == NearestHeapSize)
+                {
+                    NearestDepthFirst(child, point, distance, results, count, bound);
+                    continue;
+                }
+
+                heap[size++] = {childDistanceSq, child};
+                std::push_heap(heap, heap + size, std::greater<>{});
+            }
+        }
+
+        return count;
+    }
+
+    template <typename F>
+    void AABBTree::NearestVisitLeaf(uint32_t bodyID, F &distance, std::span<NearestResult> results, size_t &count, float &bound) const noexcept
+    {
+        float d = distance(bodyID);
+
+        if (d < 0.f || d > bound)
+            return;
+
+        // Insertion into the sorted results, k is small
+        size_t i = count < results.size() ? count++ : count - 1;
+        while (i > 0 && results[i - 1].distance > d)
+        {
+            results[i] = results[i - 1];
+            --i;
+        }
+        results[i] = {bodyID, d};
+
+        if (count == results.size())
+            bound = std::min(bound, results[count - 1].distance);
+    }
+
+    template <typename F>
+    void AABBTree::NearestDepthFirst(uint32_t index, const math::Vec2 &point, F &distance, std::span<NearestResult> results, size_t &count, float &bound) const noexcept
+    {
+        const Node &node = nodes[index];
+
+        if (PointAABBDistanceSq(point, node.aabb) > bound * bound)
+            return;
+
+        if (node.isLeaf())
+        {
+            NearestVisitLeaf(static_cast<uint32_t>(node.objectID), distance, results, count, bound);
+            return;
+        }
+
+        // Closer child first so the bound shrinks sooner
+        uint32_t first = node.children[0];
+        uint32_t second = node.children[1];
+        if (PointAABBDistanceSq(point, nodes[second].aabb) < PointAABBDistanceSq(point, nodes[first].aabb))
+            std::swap(first, second);
+
+        NearestDepthFirst(first, point, distance, results, count, bound);
+        NearestDepthFirst(second, point, distance, results, count, bound);
+    }
+
+    template <typename Test, typename F>
+    void AABBTree::Traverse(const Test &test, F &visitor) const noexcept
+    {
+        if (root == NullNode)
+            return;
+
+        if (nodes[root].height >= QueryStackSize - 1)
+        {
+            TraverseStackless(test, visitor);
+            return;
+        }
+
+        uint32_t stack[QueryStackSize];
+        int top = 0;
+        stack[top++] = root;
+
+        while (top > 0)
+        {
+            const Node &node = nodes[stack[--top]];
+
+            if (!test(node))
+                continue;
+
+            if (node.isLeaf())
+            {
+                if (!Visit(visitor, static_cast<uint32_t>(node.objectID)))
+                    return;
+            }
+            else
+            {
+                stack[top++] = node.children[1];
+                stack[top++] = node.children[0];
+            }
+        }
+    }
+
+    template <typename Test, typename F>
+    void AABBTree::TraverseStackless(const Test &test, F &visitor) const noexcept
+    {
+        uint32_t current = root;
+        uint32_t previous = NullNode;
+
+        while (current != NullNode)
+        {
+            const Node &node = nodes[current];
+            uint32_t next;
+
+            if (previous == node.parent)
+            {
+                // Coming down
+                if (!test(node))
+                {
+                    next = node.parent;
+                }
+                else if (node.isLeaf())
+                {
+                    if (!Visit(visitor, static_cast<uint32_t>(node.objectID)))
+                        return;
+
+                    next = node.parent;
+                }
+                else
+                {
+                    next = node.children[0];
+                }
+            }
+            else if (previous == node.children[0])
+            {
+                next = node.children[1];
+            }
+            else
+            {
+                next = node.parent;
+            }
+
+            previous = current;
+            current = next;
+        }
+    }
+
 } // namespace sas
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "AABBTree.hpp"
+
+namespace sas
+{
+    // Stack of hashed uniform grids over a store of body boxes, the cells are rebuilt from scratch by Build
+    // Level l has cells of minCellSize * 4^l, every body is stored once, in the cell of its min corner
+    // on the lowest level whose cells are at least as big as the body
+    // Scenes that mix tiny and huge bodies keep one entry per body, where a SpatialHashGrid would
+    // either store big bodies in hundreds of cells or put hundreds of small ones in one cell
+    // Bodies too big for the top level's cells are kept aside and tested against everyone
+    class HierarchicalGrid
+    {
+    private:
+        static constexpr int MaxLevels = 16;
+
+        // Cell growth from one level to the next, 2 leaves many thin levels that all have to be looked up
+        static constexpr float LevelScale = 4.f;
+
+        // Cell coordinates are clamped so far away boxes can't overflow an int32
+        static constexpr float CellLimit = static_cast<float>(1 << 30);
+
+        struct CellEntry
+        {
+            AABB aabb;
+            int32_t cellX;
+            int32_t cellY;
+            uint32_t bodyID;
+            uint32_t collisionMask;
+            int32_t level;
+        };
+
+        struct Level
+        {
+            float cellSize = 0.f;
+            float invCellSize = 0.f;
+
+            // Bodies of the level are levelOrder[first, first + count)
+            uint32_t first = 0;
+            uint32_t count = 0;
+
+            // OR of the bodies' collision masks, 0 for an empty level
+            uint32_t collisionMask = 0;
+
+            float sumWidth = 0.f;
+            float sumHeight = 0.f;
+
+            // Cells of a row in the bounds, plus where the level starts in the table
+            uint32_t rowPitch = 1;
+            uint32_t bucketOffset = 0;
+        };
+
+        Level levels[MaxLevels];
+
+        // Boxes the grid is built from, swap and pop on removal, cell coordinates and level unused
+        // proxySlots holds where each body id sits in proxies, NullNode when absent
+        std::vector<CellEntry> proxies;
+        std::vector<uint32_t> proxySlots;
+
+        // Counting sorted by bucket, the entries of bucket b are [bucketStart[b], bucketStart[b + 1])
+        // Cells go into the table row by row and wrap around, so neighbouring cells are close in memory
+        // Cells of every level share the table, the cell coordinates and level tell them apart
+        std::vector<CellEntry> entries;
+        std::vector<CellEntry> unsorted;
+        std::vector<uint32_t> bucketStart;
+        std::vector<uint32_t> entryBuckets;
+        uint32_t bucketMask = 0;
+
+        // Indices into entries grouped by level
+        std::vector<uint32_t> levelOrder;
+
+        // Bodies too big for the top level and, only when there are some, every other body
+        // Both sorted by minX so each oversized body sweeps the others along x, cell coordinates unused
+        std::vector<CellEntry> oversized;
+        std::vector<CellEntry> gridProxies;
+
+        // Around every body in the levels, for the density estimate of QueryCost
+        AABB bounds{};
+
+        [[nodiscard]] int32_t CellCoord(float v, int level) const noexcept
+        {
+            // fmax also maps NaN to the lower limit
+            return static_cast<int32_t>(std::fmin(std::fmax(std::floor(v * levels[level].invCellSize), -CellLimit), CellLimit));
+        }
+
+        [[nodiscard]] uint32_t Bucket(int32_t cellX, int32_t cellY, int level) const noexcept
+        {
+            const Level &info = levels[level];
+            return (static_cast<uint32_t>(cellY) * info.rowPitch + static_cast<uint32_t>(cellX) + info.bucketOffset) & bucketMask;
+        }
+
+        // Estimated bucket lookups and box tests for every body of level from to find its partners on level to
+        [[nodiscard]] float QueryCost(int from, int to) const noexcept;
+
+        // Pairs between the bodies of from and the bodies of to, each pair once when from == to
+        void QueryLevel(int from, int to, std::vector<BroadPair> &pairs) const noexcept;
+
+    public:
+        // Adds the body or replaces its box and mask, the levels only see it at the next Build
+        void SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept;
+        void RemoveProxy(uint32_t bodyID) noexcept;
+
+        [[nodiscard]] bool Contains(uint32_t bodyID) const noexcept
+        {
+            return bodyID < proxySlots.size() && proxySlots[bodyID] != NullNode;
+        }
+
+        [[nodiscard]] size_t GetProxyCount() const noexcept
+        {
+            return proxies.size();
+        }
+
+        // Sorts every stored proxy into the level its size fits
+        void Build(float minCellSize) noexcept;
+
+        // Same contract as AABBTree::FindAllPairs
+        void FindAllPairs(std::vector<BroadPair> &pairs) const noexcept;
+
+        // Bodies stored on level, 0 past the last level
+        [[nodiscard]] size_t GetLevelCount(int level) const noexcept
+        {
+            return level >= 0 && level < MaxLevels ? levels[level].count : 0;
+        }
+
+        [[nodiscard]] size_t GetOversizedCount() const noexcept
+        {
+            return oversized.size();
+        }
+
+        // Drops the proxies as well
+        void Clear() noexcept;
+    };
+
+} // namespace sas
@@ -1,18 +1,89 @@
 #pragma once
 #include <vector>
+#include <span>
+#include <optional>
 
 #include "AABBTree.hpp"
+#include "WideBVH.hpp"
+#include "QuantizedBVH.hpp"
+#include "SpatialHashGrid.hpp"
+#include "SweepAndPrune.hpp"
+#include "HierarchicalGrid.hpp"
 #include "Primitives.hpp"
 
 namespace sas
 {
     struct CollisionInfo;
+
+    // Fat box a moving body is stored with in the dynamic tree, from its tight box and the Step's dt
+    // Called for every active body every Step, so keep it cheap
+    using FatAABBPolicy = AABB (*)(const Body &body, const AABB &tight, float dt) noexcept;
+
+    // Margin of max(2, 3 frames of travel) on all four sides
+    AABB UniformMarginPolicy(const Body &body, const AABB &tight, float dt) noexcept;
+    // Margin of 2 on all sides, plus 3 frames of travel only in the direction of the velocity
+    AABB SweptMarginPolicy(const Body &body, const AABB &tight, float dt) noexcept;
+
+    // Structure that pairs dynamic bodies with each other, pairs with statics always come from the static tree
+    enum struct BroadphaseType
+    {
+        // Incremental, only the bodies that moved are queried against the dynamic tree
+        Tree,
+        // SpatialHashGrid rebuilt from the fat boxes, every dynamic pair is found again each Step something moved
+        // The dynamic tree is left alone, scene queries bring it up to date when they need it
+        Grid,
+        // SweepAndPrune along x kept sorted between Steps, applies the pairs that started and ended
+        // Fed the fat boxes like Grid, for levels that are long in x and short in y
+        SweepAndPrune,
+        // HierarchicalGrid rebuilt like Grid, for scenes mixing small debris with big bodies
+        HierarchicalGrid
+    };
+
     struct PhysicsSettings
     {
         float gravity = 500.f;
         float dragCoeff = 0.47f;
         float groundFriction = 0.98f;
         float wallFriction = 0.98f;
+
+        UpdateMode treeUpdateMode = UpdateMode::Adaptive;
+        float refitGrowthLimit = 0.5f;
+
+        // Internal nodes of the dynamic tree reinserted per Step to undo the damage of incremental updates, 0 = off
+        uint32_t treeOptimizeBudget = 8;
+
+        FatAABBPolicy fatAABBPolicy = SweptMarginPolicy;
+
+        BroadphaseType broadphase = BroadphaseType::Tree;
+        // Edge of a BroadphaseType::Grid cell, about the size of a typical fat box works best
+        float gridCellSize = 32.f;
+        // Cell edge of the finest BroadphaseType::HierarchicalGrid level, each level above is 4 times as big
+        float hierarchicalGridMinCellSize = 8.f;
+        // Growth of every box in a QueryBackend::Quantized snapshot, more means fewer rebuilds but looser queries
+        float quantizedPadding = 20.f;
+    };
+
+    // Structure the broadphase pair queries run against
+    enum struct QueryBackend
+    {
+        Binary,
+        // AABBTree collapsed into a WideBVH, refitted with the bodies that moved and collapsed again once they add up to every body
+        // Steps where only a few bodies moved and the snapshot is out of date query the binary tree
+        Wide4,
+        // AABBTree compressed into a QuantizedBVH with padded boxes, for very large scenes
+        // Built again once a body's fat box leaves its padded box, so it suits scenes where most bodies rest or drift slowly
+        Quantized
+    };
+
+    // Broadphase counters for the last Step
+    struct BroadphaseStats
+    {
+        uint32_t refits = 0;
+        uint32_t reinserts = 0;
+        uint32_t optimized = 0;
+        int treeHeight = 0;
+        // AABBTree::GetSAHCost of the dynamic tree, lower is better
+        float sahCost = 0.f;
     };
 
     struct Contact
@@ -27,6 +98,34 @@ namespace sas
 
     struct BodyHandle;
 
+    // Description of a body for batch creation
+    struct BodyDef
+    {
+        Shape shape;
+        Transform transform;
+        Kinematics kinematics{};
+        uint32_t options = Flags::Active | Flags::RigidBody;
+    };
+
+    // Segment from origin to origin + translation
+    struct Ray
+    {
+        math::Vec2 origin;
+        math::Vec2 translation;
+    };
+
+    struct RayHit
+    {
+        bool hit = false;
+        uint32_t bodyID = 0;
+
+        math::Vec2 point;
+        math::Vec2 normal;
+
+        // Along the ray translation, 0 = origin, 1 = end
+        float fraction = 1.f;
+    };
+
     class PhysicsWorld
     {
     public:
@@ -35,7 +134,42 @@ namespace sas
 
     private:
         Rectangle boundaries;
-        AABBTree root;
+
+        // Static bodies never move, their tree is only rebuilt when statics are added
+        AABBTree dynamicTree;
+        AABBTree staticTree;
+        std::vector<uint32_t> pendingStatics;
+
+        QueryBackend queryBackend;
+        WideBVH wideTree;
+        QuantizedBVH quantizedTree;
+
+        // Whether QueryBroadphase can use the snapshot of queryBackend, and the fat boxes refitted into it since its build
+        bool snapshotValid = false;
+        size_t snapshotRefits = 0;
+
+        // A snapshot is only rebuilt for a Step where at least one body in this many moved, fewer query the binary tree
+        static constexpr size_t SnapshotRebuildRatio = 8;
+        SpatialHashGrid hashGrid;
+        SweepAndPrune sweepAndPrune;
+        HierarchicalGrid hierarchicalGrid;
+
+        // Broadphase the pairs were found with, Step switches to settings.broadphase
+        BroadphaseType activeBroadphase = BroadphaseType::Tree;
+
+        // Fat boxes of the dynamic bodies by body id while the dynamic tree is not the broadphase
+        // Replaced the way AABBTree::UpdateObject does it, movedProxies is the move buffer that goes with them
+        std::vector<AABB> proxyBoxes;
+        std::vector<uint32_t> movedProxies;
+
+        // The dynamic tree keeps its bodies but not their boxes while another broadphase runs
+        bool dynamicTreeStale = false;
+
+        // Pairs whose fat boxes overlap, sorted and kept between Steps
+        // Only bodies that moved get re-paired
+        std::vector<BroadPair> pairs;
+        std::vector<BroadPair> newPairs;
+        std::vector<uint8_t> moveFlags;
 
     public:
         // Cashe locality
@@ -58,6 +192,38 @@ namespace sas
         BodyHandle CreateBody(Shape shape, const Transform &trans, uint32_t options = Flags::Active | Flags::RigidBody) noexcept;
         BodyHandle CreateBody(Shape shape, const Transform &trans, const Kinematics &kin, uint32_t options = Flags::Active | Flags::RigidBody) noexcept;
 
+        // Level loading, the tree is rebuilt once for the whole batch instead of an insert per body
+        std::vector<BodyHandle> CreateBodies(std::span<const BodyDef> defs) noexcept;
+
+        // Rebuilds the dynamic tree from scratch on threadCount threads (0 = all cores)
+        // Call now and then in long running scenes where incremental updates degrade the tree
+        void RebuildBroadphase(uint32_t threadCount = 0) noexcept;
+
+        // Closest body on the segment whose layer is in layerMask
+        // Rays starting inside a body do not hit it
+        [[nodiscard]] RayHit RayCast(const Ray &ray, uint32_t layerMask = Flags::LayerAll) noexcept;
+
+        // RayCast for every ray, hits[i] belongs to rays[i], only the first min(rays.size(), hits.size()) rays are cast
+        // Rays go down the trees four at a time, so neighbouring rays should be close to each other
+        void RayCastBatch(std::span<const Ray> rays, std::span<RayHit> hits, uint32_t layerMask = Flags::LayerAll) noexcept;
+
+        // First body hit while moving shape from trans by translation, without rotating it
+        // fraction is along translation, normal points from the body hit towards the shape
+        // A shape that already overlaps a body hits it at fraction 0
+        // If the search runs out of steps while still closing in, the hit is reported early rather than missed
+        [[nodiscard]] RayHit ShapeCast(Shape shape, const Transform &trans, math::Vec2 translation, uint32_t layerMask = Flags::LayerAll) noexcept;
+
+        // Up to results.size() bodies closest to point within maxDist, sorted, returns how many were found
+        // Distances are to the body's surface, 0 when point is inside
+        size_t QueryNearest(const math::Vec2 &point, std::span<NearestResult> results, float maxDist = std::numeric_limits<float>::max(),
+                            uint32_t layerMask = Flags::LayerAll) noexcept;
+
+        // A body whose shape contains point, dynamic bodies are preferred over statics
+        [[nodiscard]] std::optional<uint32_t> QueryPoint(const math::Vec2 &point, uint32_t layerMask = Flags::LayerAll) noexcept;
+
+        // Changes Body::collisionMask and lets the broadphase know, so new pairs are found next Step
+        void SetCollisionMask(uint32_t bodyID, uint32_t collisionMask) noexcept;
+
         void AddToCollisionPool(Body &body) noexcept;
         void RemoveFromCollisionPool(Body &body) noexcept;
         void Step(float dt) noexcept;
@@ -66,13 +232,14 @@ namespace sas
         [[nodiscard]] bool IsBodyInCollision(uint32_t id) const noexcept;
         [[nodiscard]] Body &GetBody(uint32_t id) noexcept;
         [[nodiscard]] std::vector<CollisionInfo> GetAllCollisions(uint32_t id) noexcept;
+        [[nodiscard]] BroadphaseStats GetBroadphaseStats() const noexcept;
 
         void RemoveBody(const BodyHandle &handle) noexcept;
         void RemoveBody(uint32_t bodyID) noexcept;
 
         void Clear() noexcept;
 
-        PhysicsWorld(Rectangle dims) noexcept;
+        PhysicsWorld(Rectangle dims, QueryBackend backend = QueryBackend::Binary) noexcept;
         ~PhysicsWorld() noexcept = default;
 
     private:
@@ -82,7 +249,7 @@ namespace sas
 
         void ResolveConstraints(Body &obj, float dt) const noexcept;
         void CheckCollisionCircleCircle(Body &obj, Body &other) noexcept;
-        void CheckCollisionDispatcher(Body &obj) noexcept;
+        void CheckCollisionDispatcher(const BroadPair &pair) noexcept;
         void CheckCollisionBoxBox(Body &obj, Body &other) noexcept;
         void CheckCollisionCircleBox(Body &obj, Body &other) noexcept;
         void CheckCollisionBoxCircle(Body &obj, Body &other) noexcept;
@@ -90,11 +257,59 @@ namespace sas
         void ResolveColision(Body &obj, Body &other, math::Vec2 normal, float overlap, const std::pair<math::Vec2, math::Vec2>& rotComp) noexcept;
         void UpdateCollisionFlags() noexcept;
 
+        void UpdatePairs() noexcept;
+        void UpdateSnapshot(const std::vector<uint32_t> &moved) noexcept;
+        void SwitchBroadphase() noexcept;
+        // Grows the dynamic tree's leaves over proxyBoxes, before anything reads the tree
+        void SyncDynamicTree() noexcept;
+
+        [[nodiscard]] bool UsesDynamicTree() const noexcept;
+        [[nodiscard]] bool HasDynamicProxy(uint32_t bodyID) const noexcept;
+        // Stores the fat box of a body while the dynamic tree is not the broadphase
+        void AddProxy(const Body &body, const AABB &fat) noexcept;
+        void UpdateProxy(const Body &body, const AABB &tight, float dt) noexcept;
+        void FlushStaticTree() noexcept;
+        void MergeNewPairs() noexcept;
+
+        [[nodiscard]] bool IsStatic(uint32_t bodyID) const noexcept;
+        [[nodiscard]] const AABB &GetProxyAABB(uint32_t bodyID) const noexcept;
+
+        template <typename F>
+        void QueryBroadphase(const AABB &aabb, uint32_t collisionMask, F &&visitor) const noexcept
+        {
+            if (queryBackend == QueryBackend::Wide4 && snapshotValid)
+            {
+                // Bodies removed since the build are still in the snapshot
+                wideTree.QueryVisit(aabb, collisionMask, [this, &visitor](uint32_t bodyID)
+                                    {
+                                        if (dynamicTree.Contains(bodyID))
+                                            visitor(bodyID); });
+            }
+            else if (queryBackend == QueryBackend::Quantized && snapshotValid)
+            {
+                // No layer summaries in the compressed nodes and padded boxes, filter the leaves instead
+                // Bodies removed since the build are still in the snapshot
+                quantizedTree.QueryVisit(aabb, [this, &aabb, collisionMask, &visitor](uint32_t bodyID)
+                                         {
+                                             if (dynamicTree.Contains(bodyID) && AABBOverlap(aabb, dynamicTree.GetFatAABB(bodyID)) &&
+                                                 CanCollide(collisionMask, bodies[sparse[bodyID]].collisionMask))
+                                                 visitor(bodyID); });
+            }
+            else
+            {
+                dynamicTree.QueryVisit(aabb, collisionMask, visitor);
+            }
+        }
+
+        void DestroyPairs(uint32_t bodyID) noexcept;
+
         void Reset(Body &obj) const noexcept;
 
         [[nodiscard]] uint32_t GetNextId() noexcept;
 
-        BodyHandle CreateBodyFull(Shape shape, const Transform &trans, const Kinematics &kin, uint32_t options) noexcept;
+        // When deferredProxies is set the proxy is collected there instead of inserted into the tree
+        BodyHandle CreateBodyFull(Shape shape, const Transform &trans, const Kinematics &kin, uint32_t options,
+                                  std::vector<TreeProxy> *deferredProxies = nullptr) noexcept;
 
         void ResolveBroadLower(Body &obj, float wall) const noexcept;
         void ResolveBroadHigher(Body &obj, float wall) const noexcept;
@@ -206,13 +421,13 @@ namespace sas
         {
             auto &b = world->GetBody(id);
 
-            b.collisionMask = (b.collisionMask & 0x0000FFFF) | (mask & 0xFFFF0000);
+            world->SetCollisionMask(id, (b.collisionMask & 0x0000FFFF) | (mask & 0xFFFF0000));
         }
 
         void SetLayer(uint32_t layerBits) noexcept
         {
             auto &b = world->GetBody(id);
-            b.collisionMask = (b.collisionMask & 0xFFFF0000) | (layerBits & 0x0000FFFF);
+            world->SetCollisionMask(id, (b.collisionMask & 0xFFFF0000) | (layerBits & 0x0000FFFF));
         }
 
         void SetCollision(uint32_t layer, uint32_t mask) noexcept
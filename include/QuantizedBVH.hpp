@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "AABBTree.hpp"
+
+namespace sas
+{
+    // Marks a QuantizedNode child as a body id instead of a node index
+    inline constexpr uint32_t QuantizedLeafBit = 1u << 31;
+
+    // Both child boxes as 16 bit offsets inside the node's own decoded box, 24 bytes
+    struct QuantizedNode
+    {
+        uint16_t minX[2], minY[2];
+        uint16_t maxX[2], maxY[2];
+
+        // NullNode for the missing child of a single body tree
+        uint32_t children[2];
+    };
+
+    static_assert(sizeof(QuantizedNode) == 24);
+
+    // Read only compressed snapshot of an AABBTree
+    // Boxes are rounded outwards, so queries may report a few extra bodies but never miss one
+    // Every child is encoded against its parent, so one box can't be refitted without re-encoding everything below
+    // Build pads the boxes instead, the snapshot holds while the bodies' fat boxes stay inside what they were encoded with
+    class QuantizedBVH
+    {
+    private:
+        std::vector<QuantizedNode> nodes;
+        AABB rootBox{};
+        int depth = 0;
+        float padding = 0.f;
+
+        // Padded box of each body by body id, inverted for bodies not in the snapshot
+        // Only Covers reads them, queries stay on the nodes
+        std::vector<AABB> leafBounds;
+
+        static constexpr float QuantizedMax = 65535.f;
+
+        uint32_t BuildNode(const AABBTree &tree, uint32_t binaryNode, const AABB &decoded, int level) noexcept;
+
+        // Child box of node in parent's space, the same arithmetic at build and query time
+        static AABB Decode(const QuantizedNode &node, int child, const AABB &parent) noexcept;
+        static void Encode(QuantizedNode &node, int child, const AABB &box, const AABB &parent) noexcept;
+
+        template <typename F>
+        bool QueryRecursive(uint32_t node, const AABB &decoded, const AABB &aabb, F &visitor) const noexcept;
+
+        [[nodiscard]] AABB Pad(const AABB &aabb) const noexcept
+        {
+            return {aabb.minX - padding, aabb.minY - padding, aabb.maxX + padding, aabb.maxY + padding};
+        }
+
+    public:
+        // Every box goes in grown by padding on each side
+        void Build(const AABBTree &tree, float padding = 0.f) noexcept;
+
+        // Whether the current fat boxes of bodyIDs in tree still lie inside the boxes they were encoded with
+        // Bodies removed from tree since the Build are skipped, they stay in the snapshot and queries still report them
+        [[nodiscard]] bool Covers(const AABBTree &tree, std::span<const uint32_t> bodyIDs) const noexcept;
+
+        // Same contract as AABBTree::QueryVisit
+        template <typename F>
+        void QueryVisit(const AABB &aabb, F &&visitor) const noexcept;
+
+        [[nodiscard]] size_t GetNodeCount() const noexcept
+        {
+            return nodes.size();
+        }
+
+        [[nodiscard]] size_t GetMemoryUsage() const noexcept
+        {
+            return nodes.size() * sizeof(QuantizedNode) + leafBounds.size() * sizeof(AABB);
+        }
+
+        void Clear() noexcept;
+    };
+
+    inline AABB QuantizedBVH::Decode(const QuantizedNode &node, int child, const AABB &parent) noexcept
+    {
+        float scaleX = (parent.maxX - parent.minX) / QuantizedMax;
+        float scaleY = (parent.maxY - parent.minY) / QuantizedMax;
+
+        // min + 65535 * scale can land a float step inside the parent's max, the top code is the max itself
+        // Code 0 needs no such care, min + 0 is exact
+        constexpr uint16_t TopCode = static_cast<uint16_t>(QuantizedMax);
+
+        return {parent.minX + node.minX[child] * scaleX, parent.minY + node.minY[child] * scaleY,
+                node.maxX[child] == TopCode ? parent.maxX : parent.minX + node.maxX[child] * scaleX,
+                node.maxY[child] == TopCode ? parent.maxY : parent.minY + node.maxY[child] * scaleY};
+    }
+
+    template <typename F>
+    void QuantizedBVH::QueryVisit(const AABB &aabb, F &&visitor) const noexcept
+    {
+        if (nodes.empty() || !AABBOverlap(rootBox, aabb))
+            return;
+
+        if (depth >= QueryStackSize - 1)
+        {
+            QueryRecursive(0, rootBox, aabb, visitor);
+            return;
+        }
+
+        struct Entry
+        {
+            uint32_t node;
+            AABB box;
+        };
+
+        Entry stack[QueryStackSize];
+        int top = 0;
+        stack[top++] = {0, rootBox};
+
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            const QuantizedNode &node = nodes[entry.node];
+
+            for (int i = 0; i < 2; ++i)
+            {
+                uint32_t child = node.children[i];
+                if (child == NullNode)
+                    continue;
+
+                AABB box = Decode(node, i, entry.box);
+                if (!AABBOverlap(box, aabb))
+                    continue;
+
+                if (child & QuantizedLeafBit)
+                {
+                    if (!AABBTree::Visit(visitor, child & ~QuantizedLeafBit))
+                        return;
+                }
+                else
+                {
+                    stack[top++] = {child, box};
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    bool QuantizedBVH::QueryRecursive(uint32_t index, const AABB &decoded, const AABB &aabb, F &visitor) const noexcept
+    {
+        const QuantizedNode &node = nodes[index];
+
+        for (int i = 0; i < 2; ++i)
+        {
+            uint32_t child = node.children[i];
+            if (child == NullNode)
+                continue;
+
+            AABB box = Decode(node, i, decoded);
+            if (!AABBOverlap(box, aabb))
+                continue;
+
+            if (child & QuantizedLeafBit)
+            {
+                if (!AABBTree::Visit(visitor, child & ~QuantizedLeafBit))
+                    return false;
+            }
+            else if (!QueryRecursive(child, box, aabb, visitor))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+} // namespace sas
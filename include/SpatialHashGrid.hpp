@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "AABBTree.hpp"
+
+namespace sas
+{
+    // Uniform grid over a store of body boxes, the cells are rebuilt from scratch by Build
+    // Cells are hashed into a fixed table, so the grid has no bounds and its memory follows the body count
+    // Works best when bodies are about one cell in size, a body is stored once per cell it touches
+    // Bodies touching more than MaxCellsPerProxy cells are kept aside and tested against everyone
+    class SpatialHashGrid
+    {
+    private:
+        // One per cell a body touches, the box is copied in so pair tests stay inside the bucket
+        struct CellEntry
+        {
+            AABB aabb;
+            int32_t cellX;
+            int32_t cellY;
+            uint32_t bodyID;
+            uint32_t collisionMask;
+        };
+
+        static_assert(sizeof(CellEntry) == 32);
+
+        // Past this a body costs more in cells than testing it against every other body
+        static constexpr int64_t MaxCellsPerProxy = 1024;
+
+        // Cell coordinates are clamped so far away or huge boxes can't overflow an int32
+        static constexpr float CellLimit = static_cast<float>(1 << 30);
+
+        // Boxes the grid is built from, swap and pop on removal, cell coordinates unused
+        // proxySlots holds where each body id sits in proxies, NullNode when absent
+        std::vector<CellEntry> proxies;
+        std::vector<uint32_t> proxySlots;
+
+        // Proxies that went into the cells at the last Build
+        std::vector<uint32_t> gridded;
+
+        // Counting sorted by bucket, the entries of bucket b are [bucketStart[b], bucketStart[b + 1])
+        // Different cells can share a bucket, the cell coordinates tell them apart
+        std::vector<CellEntry> entries;
+        std::vector<uint32_t> bucketStart;
+        uint32_t bucketMask = 0;
+
+        // Bodies over MaxCellsPerProxy cells and, only when there are some, every other body
+        // Both sorted by minX so each oversized body sweeps the others along x, cell coordinates unused
+        std::vector<CellEntry> oversized;
+        std::vector<CellEntry> gridProxies;
+
+        float invCellSize = 1.f;
+
+        [[nodiscard]] int32_t CellCoord(float v) const noexcept
+        {
+            // fmax also maps NaN to the lower limit
+            return static_cast<int32_t>(std::fmin(std::fmax(std::floor(v * invCellSize), -CellLimit), CellLimit));
+        }
+
+        [[nodiscard]] uint32_t Bucket(int32_t cellX, int32_t cellY) const noexcept
+        {
+            return ((static_cast<uint32_t>(cellX) * 73856093u) ^ (static_cast<uint32_t>(cellY) * 19349663u)) & bucketMask;
+        }
+
+    public:
+        // Adds the body or replaces its box and mask, the cells only see it at the next Build
+        void SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept;
+        void RemoveProxy(uint32_t bodyID) noexcept;
+
+        [[nodiscard]] bool Contains(uint32_t bodyID) const noexcept
+        {
+            return bodyID < proxySlots.size() && proxySlots[bodyID] != NullNode;
+        }
+
+        [[nodiscard]] size_t GetProxyCount() const noexcept
+        {
+            return proxies.size();
+        }
+
+        // Sorts every stored proxy into the cells
+        void Build(float cellSize) noexcept;
+
+        // Same contract as AABBTree::FindAllPairs
+        void FindAllPairs(std::vector<BroadPair> &pairs) const noexcept;
+
+        [[nodiscard]] size_t GetEntryCount() const noexcept
+        {
+            return entries.size();
+        }
+
+        [[nodiscard]] size_t GetOversizedCount() const noexcept
+        {
+            return oversized.size();
+        }
+
+        // Drops the proxies as well
+        void Clear() noexcept;
+    };
+
+} // namespace sas
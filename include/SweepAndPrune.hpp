@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "AABBTree.hpp"
+
+namespace sas
+{
+    // Persistent sweep and prune along x, endpoints stay sorted between Updates
+    // Only bodies given a new box since the last Update are looked at, each of their endpoints is moved into place one swap at a time
+    // and a min crossing a max of another body is what starts or ends their overlap, so a coherent frame costs a few swaps
+    // Suits levels that are long in x and short in y, bodies sharing an x range are all tested against each other
+    class SweepAndPrune
+    {
+    private:
+        // Min or max x of a body, data is bodyID << 1, plus 1 for a max
+        struct Endpoint
+        {
+            float value;
+            uint32_t data;
+        };
+
+        std::vector<Endpoint> endpoints;
+
+        // Indexed by body id, index holds where its min and max endpoints sit
+        // aabb is the latest box given to SetProxy, its y and the mask are in effect right away
+        struct Proxy
+        {
+            uint32_t index[2];
+            AABB aabb;
+            uint32_t collisionMask;
+            uint32_t stamp;
+            bool present;
+            bool fresh;
+        };
+
+        std::vector<Proxy> proxies;
+
+        // One side of an x overlap, mirror is where the other side sits in bodyID's list
+        // paired is set on both sides while the two also overlap in y and CanCollide
+        struct Partner
+        {
+            uint32_t bodyID;
+            uint32_t mirror;
+            bool paired;
+        };
+
+        // Indexed by body id, every body it overlaps in x, this is the persistent pair set
+        std::vector<std::vector<Partner>> partners;
+        size_t pairCount = 0;
+
+        // Proxies given a box since the last Update carry the current stamp, 0 is never current
+        uint32_t stamp = 1;
+
+        // Pair events in the order the swaps made them, a pair can start and end in one Update
+        std::vector<BroadPair> addedEvents;
+        std::vector<BroadPair> removedEvents;
+
+        // What the events add up to, sorted
+        std::vector<BroadPair> addedPairs;
+        std::vector<BroadPair> removedPairs;
+
+        // Bodies given a box since the last Update
+        std::vector<uint32_t> moved;
+        std::vector<uint32_t> rechecked;
+        std::vector<uint32_t> newcomers;
+
+        // Body whose x range the bulk sweep is inside of
+        std::vector<uint32_t> active;
+        std::vector<uint32_t> activeSlot;
+
+        size_t swapCount = 0;
+
+        // More new bodies than this in one Update are sorted in one go instead of one by one
+        static constexpr size_t InsertionSortLimit = 32;
+
+        // Mins go first on equal values, so touching boxes overlap like they do in AABBOverlap
+        static bool Less(const Endpoint &a, const Endpoint &b) noexcept
+        {
+            return a.value < b.value || (!(b.value < a.value) && !(a.data & 1) && (b.data & 1));
+        }
+
+        static uint64_t PairKey(const BroadPair &pair) noexcept
+        {
+            return (static_cast<uint64_t>(pair.bodyA) << 32) | pair.bodyB;
+        }
+
+        [[nodiscard]] bool OverlapY(const Proxy &a, const Proxy &b) const noexcept
+        {
+            return a.aabb.minY <= b.aabb.maxY && b.aabb.minY <= a.aabb.maxY;
+        }
+
+        void Cross(uint32_t index) noexcept;
+        void SortDown(uint32_t index) noexcept;
+        void SortUp(uint32_t index) noexcept;
+
+        void Link(uint32_t a, uint32_t b) noexcept;
+        void Unlink(uint32_t a, uint32_t b) noexcept;
+        void Detach(uint32_t bodyID, uint32_t slot, bool report) noexcept;
+        void ErasePartner(uint32_t bodyID, uint32_t slot) noexcept;
+        void Test(uint32_t bodyID, uint32_t slot) noexcept;
+
+        void Insert(uint32_t bodyID) noexcept;
+        void InsertBulk() noexcept;
+        void Drop(uint32_t bodyID, bool report) noexcept;
+
+    public:
+        // Adds the body or gives it a new box and mask, the pairs change at the next Update
+        void SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept;
+
+        // Sorts the bodies given a box since the last Update into place and adds the new ones
+        void Update() noexcept;
+
+        // Drops the body and its pairs right away, without a removed event
+        void Remove(uint32_t bodyID) noexcept;
+
+        [[nodiscard]] bool Contains(uint32_t bodyID) const noexcept
+        {
+            return bodyID < proxies.size() && proxies[bodyID].present;
+        }
+
+        // Appends every pair of bodies that overlap and CanCollide, same contract as AABBTree::FindAllPairs
+        void GetPairs(std::vector<BroadPair> &pairs) const noexcept;
+
+        [[nodiscard]] size_t GetPairCount() const noexcept
+        {
+            return pairCount;
+        }
+
+        // Pairs that started overlapping in the last Update, sorted
+        [[nodiscard]] const std::vector<BroadPair> &GetAddedPairs() const noexcept
+        {
+            return addedPairs;
+        }
+
+        // Pairs that stopped overlapping in the last Update, sorted
+        [[nodiscard]] const std::vector<BroadPair> &GetRemovedPairs() const noexcept
+        {
+            return removedPairs;
+        }
+
+        // Endpoint swaps made in the last Update, stays low while the scene is coherent
+        [[nodiscard]] size_t GetSwapCount() const noexcept
+        {
+            return swapCount;
+        }
+
+        [[nodiscard]] bool IsEmpty() const noexcept
+        {
+            return endpoints.empty();
+        }
+
+        void Clear() noexcept;
+    };
+
+} // namespace sas
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "AABBTree.hpp"
+
+namespace sas
+{
+    // Marks a WideNode child as a body id instead of a node index
+    inline constexpr uint32_t WideLeafBit = 1u << 31;
+
+    // Four child boxes stored SoA so one node is tested with a single compare per axis
+    struct alignas(16) WideNode
+    {
+        float minX[4], minY[4];
+        float maxX[4], maxY[4];
+
+        // NullNode for empty lanes
+        uint32_t children[4];
+
+        // Node::collisionMask of each lane, 0 for empty lanes
+        uint32_t collisionMasks[4];
+    };
+
+    // Read only 4-ary snapshot of an AABBTree
+    // Build collapses the whole tree, Refit keeps the collapsed structure and only copies the boxes of the bodies that moved
+    class WideBVH
+    {
+    private:
+        std::vector<WideNode> nodes;
+        int depth = 0;
+
+        // Where each node hangs in its parent as (node << 2) | lane, NullNode for the root
+        std::vector<uint32_t> parentSlots;
+
+        // Where each body sits as (node << 2) | lane by body id, NullNode for bodies not in the snapshot
+        std::vector<uint32_t> leafSlots;
+        size_t leafCount = 0;
+
+        uint32_t BuildNode(const AABBTree &tree, uint32_t binaryNode, int level) noexcept;
+
+        static void SetLane(WideNode &node, int lane, const AABB &aabb, uint32_t collisionMask) noexcept;
+
+        // Bit i is set when lane i overlaps aabb
+        static int OverlapMask(const WideNode &node, const AABB &aabb) noexcept;
+        // Bit i is set when lane i holds a body that CanCollide with collisionMask
+        static int CollisionMask(const WideNode &node, uint32_t collisionMask) noexcept;
+
+        // lanes(node) gives the bit mask of the lanes to descend into
+        template <typename L, typename F>
+        void QueryLanes(const L &lanes, F &visitor) const noexcept;
+
+        template <typename L, typename F>
+        bool QueryRecursive(uint32_t node, const L &lanes, F &visitor) const noexcept;
+
+    public:
+        void Build(const AABBTree &tree) noexcept;
+
+        // Copies the current fat boxes and masks of bodyIDs out of tree and fixes the nodes above them
+        // Bodies removed from tree since the Build keep their old lane, queries still report them
+        // Returns false when one of the bodies is not in the snapshot, it has to be built again then
+        bool Refit(const AABBTree &tree, std::span<const uint32_t> bodyIDs) noexcept;
+
+        // Bodies the last Build put in
+        [[nodiscard]] size_t GetLeafCount() const noexcept
+        {
+            return leafCount;
+        }
+
+        // Same contract as AABBTree::QueryVisit
+        template <typename F>
+        void QueryVisit(const AABB &aabb, F &&visitor) const noexcept;
+
+        // Same contract as the masked AABBTree::QueryVisit
+        template <typename F>
+        void QueryVisit(const AABB &aabb, uint32_t collisionMask, F &&visitor) const noexcept;
+
+        [[nodiscard]] size_t GetNodeCount() const noexcept
+        {
+            return nodes.size();
+        }
+
+        void Clear() noexcept;
+    };
+
+    inline int WideBVH::OverlapMask(const WideNode &node, const AABB &aabb) noexcept
+    {
+#if defined(__SSE__)
+        __m128 overlap = _mm_and_ps(
+            _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.minX), _mm_set1_ps(aabb.maxX)),
+                       _mm_cmpge_ps(_mm_load_ps(node.maxX), _mm_set1_ps(aabb.minX))),
+            _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.minY), _mm_set1_ps(aabb.maxY)),
+                       _mm_cmpge_ps(_mm_load_ps(node.maxY), _mm_set1_ps(aabb.minY))));
+
+        return _mm_movemask_ps(overlap);
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (node.minX[i] <= aabb.maxX && node.maxX[i] >= aabb.minX &&
+                node.minY[i] <= aabb.maxY && node.maxY[i] >= aabb.minY)
+            {
+                mask |= 1 << i;
+            }
+        }
+
+        return mask;
+#endif
+    }
+
+    inline int WideBVH::CollisionMask(const WideNode &node, uint32_t collisionMask) noexcept
+    {
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (CanCollide(collisionMask, node.collisionMasks[i]))
+                mask |= 1 << i;
+        }
+
+        return mask;
+    }
+
+    template <typename F>
+    void WideBVH::QueryVisit(const AABB &aabb, F &&visitor) const noexcept
+    {
+        auto lanes = [&aabb](const WideNode &node)
+        {
+            return OverlapMask(node, aabb);
+        };
+
+        QueryLanes(lanes, visitor);
+    }
+
+    template <typename F>
+    void WideBVH::QueryVisit(const AABB &aabb, uint32_t collisionMask, F &&visitor) const noexcept
+    {
+        auto lanes = [&aabb, collisionMask](const WideNode &node)
+        {
+            int overlap = OverlapMask(node, aabb);
+            return overlap ? overlap & CollisionMask(node, collisionMask) : 0;
+        };
+
+        QueryLanes(lanes, visitor);
+    }
+
+    template <typename L, typename F>
+    void WideBVH::QueryLanes(const L &lanes, F &visitor) const noexcept
+    {
+        if (nodes.empty())
+            return;
+
+        // Every level leaves at most 3 lanes pending
+        constexpr int StackSize = 3 * QueryStackSize + 1;
+
+        if (depth >= QueryStackSize)
+        {
+            QueryRecursive(0, lanes, visitor);
+            return;
+        }
+
+        uint32_t stack[StackSize];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0)
+        {
+            const WideNode &node = nodes[stack[--top]];
+
+            int mask = lanes(node);
+            while (mask)
+            {
+                int lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+
+                uint32_t child = node.children[lane];
+
+                // NullNode has WideLeafBit set, a query covering every float still reaches empty lanes
+                if (child == NullNode)
+                    continue;
+
+                if (child & WideLeafBit)
+                {
+                    if (!AABBTree::Visit(visitor, child & ~WideLeafBit))
+                        return;
+                }
+                else
+                {
+                    stack[top++] = child;
+                }
+            }
+        }
+    }
+
+    template <typename L, typename F>
+    bool WideBVH::QueryRecursive(uint32_t index, const L &lanes, F &visitor) const noexcept
+    {
+        const WideNode &node = nodes[index];
+
+        int mask = lanes(node);
+        while (mask)
+        {
+            int lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            uint32_t child = node.children[lane];
+            if (child == NullNode)
+                continue;
+
+            if (child & WideLeafBit)
+            {
+                if (!AABBTree::Visit(visitor, child & ~WideLeafBit))
+                    return false;
+            }
+            else if (!QueryRecursive(child, lanes, visitor))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+} // namespace sas
@@ -1,6 +1,10 @@
 #include "AABBTree.hpp"
 
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <thread>
 
 sas::AABB sas::ComputeFatAABB(const Body &body, float margin) noexcept
 {
@@ -39,15 +43,16 @@ sas::AABB sas::ComputeFatAABB(const Body &body, float margin) noexcept
     return {minX - margin, minY - margin, maxX + margin, maxY + margin};
 }
 
-sas::AABB sas::ComputeTightAABB(const Body &body) noexcept
+sas::AABB sas::ComputeSweptAABB(const AABB &tight, math::Vec2 displacement, float margin) noexcept
 {
-    return ComputeFatAABB(body, 0.0f);
+    return {
+        tight.minX - margin + std::min(displacement.x, 0.f), tight.minY - margin + std::min(displacement.y, 0.f),
+        tight.maxX + margin + std::max(displacement.x, 0.f), tight.maxY + margin + std::max(displacement.y, 0.f)};
 }
 
-bool sas::AABBOverlap(const AABB &a, const AABB &b) noexcept
+sas::AABB sas::ComputeTightAABB(const Body &body) noexcept
 {
-    return (a.minX <= b.maxX && a.maxX >= b.minX) &&
-           (a.minY <= b.maxY && a.maxY >= b.minY);
+    return ComputeFatAABB(body, 0.0f);
 }
 
 sas::AABB sas::AABBUnion(const AABB &a, const AABB &b) noexcept
@@ -65,180 +70,1092 @@ float sas::GetAreaAABB(const AABB &a) noexcept
     return width * height;
 }
 
-void sas::AABBTree::insert(uint32_t bodyID, const AABB &aabb) noexcept
+uint32_t sas::AABBTree::AllocateNode() noexcept
 {
+    if (freeList == NullNode)
+    {
+        nodes.emplace_back();
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    uint32_t node = freeList;
+    freeList = nodes[node].next;
+    nodes[node] = Node{};
 
-    Node *leaf = new Node();
-    leaf->objectID = bodyID;
-    leaf->aabb = aabb;
+    return node;
+}
+
+void sas::AABBTree::FreeNode(uint32_t node) noexcept
+{
+    nodes[node].next = freeList;
+    nodes[node].objectID = -1;
+    nodes[node].height = -1;
+    freeList = node;
+}
+
+void sas::AABBTree::SetLeaf(uint32_t bodyID, uint32_t leaf) noexcept
+{
+    if (bodyID >= leafMap.size())
+    {
+        leafMap.resize(bodyID + 1, NullNode);
+    }
 
     leafMap[bodyID] = leaf;
+}
 
-    if (!root)
+uint32_t sas::AABBTree::GetCollisionMask(uint32_t bodyID) const noexcept
+{
+    return bodyID < collisionMasks.size() ? collisionMasks[bodyID] : Flags::LayerAll | Flags::MaskAll;
+}
+
+void sas::AABBTree::SetCollisionMask(uint32_t bodyID, uint32_t collisionMask) noexcept
+{
+    if (bodyID >= collisionMasks.size())
     {
-        root = leaf;
-        return;
+        collisionMasks.resize(bodyID + 1, Flags::LayerAll | Flags::MaskAll);
     }
 
-    Node *sibling = root;
-    while (!sibling->isLeaf())
+    if (collisionMasks[bodyID] == collisionMask)
+        return;
+
+    collisionMasks[bodyID] = collisionMask;
+
+    if (!Contains(bodyID))
+        return;
+
+    uint32_t leaf = leafMap[bodyID];
+    nodes[leaf].collisionMask = collisionMask;
+
+    // Ancestors only depend on their children, stop once one comes out unchanged
+    for (uint32_t walk = nodes[leaf].parent; walk != NullNode; walk = nodes[walk].parent)
     {
-        float area0 = GetAreaAABB(AABBUnion(sibling->children[0]->aabb, leaf->aabb));
-        float area1 = GetAreaAABB(AABBUnion(sibling->children[1]->aabb, leaf->aabb));
+        Node &n = nodes[walk];
+        uint32_t combined = nodes[n.children[0]].collisionMask | nodes[n.children[1]].collisionMask;
 
-        if (area0 < area1)
-            sibling = sibling->children[0];
-        else
-            sibling = sibling->children[1];
+        if (combined == n.collisionMask)
+            break;
+
+        n.collisionMask = combined;
     }
 
-    Node *oldParent = sibling->parent;
-    Node *newParent = new Node();
-    newParent->parent = oldParent;
+    // Pairs the old mask pruned have to be found again
+    moveBuffer.push_back(bodyID);
+}
+
+void sas::AABBTree::insert(uint32_t bodyID, const AABB &aabb) noexcept
+{
+    uint32_t leaf = AllocateNode();
+    nodes[leaf].objectID = bodyID;
+    nodes[leaf].aabb = aabb;
+    nodes[leaf].collisionMask = GetCollisionMask(bodyID);
+
+    SetLeaf(bodyID, leaf);
+    moveBuffer.push_back(bodyID);
 
-    if (oldParent)
+    InsertSubtree(leaf, strategy);
+}
+
+void sas::AABBTree::InsertSubtree(uint32_t node, InsertStrategy search) noexcept
+{
+    if (root == NullNode)
     {
-        if (oldParent->children[0] == sibling)
-            oldParent->children[0] = newParent;
+        root = node;
+        nodes[node].parent = NullNode;
+        return;
+    }
+
+    // Copy, AllocateNode may grow the pool
+    AABB aabb = nodes[node].aabb;
+    uint32_t sibling = (search == InsertStrategy::Greedy) ? FindSiblingGreedy(aabb) : FindSiblingBranchAndBound(aabb);
+
+    // Grabbing indices only, AllocateNode may grow the pool
+    uint32_t oldParent = nodes[sibling].parent;
+    uint32_t newParent = AllocateNode();
+    nodes[newParent].parent = oldParent;
+
+    if (oldParent != NullNode)
+    {
+        if (nodes[oldParent].children[0] == sibling)
+            nodes[oldParent].children[0] = newParent;
         else
-            oldParent->children[1] = newParent;
+            nodes[oldParent].children[1] = newParent;
     }
     else
     {
         root = newParent;
     }
 
-    newParent->children[0] = sibling;
-    newParent->children[1] = leaf;
-    sibling->parent = newParent;
-    leaf->parent = newParent;
+    nodes[newParent].children[0] = sibling;
+    nodes[newParent].children[1] = node;
+    nodes[sibling].parent = newParent;
+    nodes[node].parent = newParent;
+
+    // Balance skips nodes below height 2, the new parent needs its real height
+    // or an inserted subtree never gets rotated against its sibling
+    const Node &child0 = nodes[sibling];
+    const Node &child1 = nodes[node];
+    nodes[newParent].height = 1 + std::max(child0.height, child1.height);
+    nodes[newParent].aabb = AABBUnion(child0.aabb, child1.aabb);
+    nodes[newParent].collisionMask = child0.collisionMask | child1.collisionMask;
+
+    RefitAncestors(newParent);
+}
 
-    Node *walk = newParent;
-    while (walk != nullptr)
+void sas::AABBTree::Build(std::span<const TreeProxy> proxies, bool markMoved) noexcept
+{
+    nodes.clear();
+    freeList = NullNode;
+    root = NullNode;
+    leafMap.clear();
+
+    if (proxies.empty())
+        return;
+
+    std::vector<BuildProxy> build;
+    build.reserve(proxies.size());
+
+    for (const auto &[id, aabb] : proxies)
     {
-        walk->aabb = AABBUnion(walk->children[0]->aabb, walk->children[1]->aabb);
-        walk = walk->parent;
+        build.push_back({id, aabb, (aabb.minX + aabb.maxX) * 0.5f, (aabb.minY + aabb.maxY) * 0.5f});
+
+        if (markMoved)
+            moveBuffer.push_back(id);
     }
+
+    nodes.reserve(2 * proxies.size() - 1);
+
+    root = BuildRange(build.data(), build.data() + build.size());
 }
 
-void sas::AABBTree::Query(Node *node, const AABB &targetAABB, std::vector<uint32_t> &results) const noexcept
+uint32_t sas::AABBTree::BuildRange(BuildProxy *begin, BuildProxy *end) noexcept
 {
-    if (!node || !AABBOverlap(node->aabb, targetAABB))
+    size_t count = static_cast<size_t>(end - begin);
+
+    if (count == 1)
+    {
+        uint32_t leaf = AllocateNode();
+        nodes[leaf].objectID = begin->id;
+        nodes[leaf].aabb = begin->aabb;
+        nodes[leaf].collisionMask = GetCollisionMask(begin->id);
+        SetLeaf(begin->id, leaf);
+
+        return leaf;
+    }
+
+    float minCX = begin->centerX, maxCX = begin->centerX;
+    float minCY = begin->centerY, maxCY = begin->centerY;
+    for (BuildProxy *it = begin + 1; it != end; ++it)
+    {
+        minCX = std::min(minCX, it->centerX);
+        maxCX = std::max(maxCX, it->centerX);
+        minCY = std::min(minCY, it->centerY);
+        maxCY = std::max(maxCY, it->centerY);
+    }
+
+    // Split along the axis where the centers spread the most
+    bool splitX = (maxCX - minCX) >= (maxCY - minCY);
+    float axisMin = splitX ? minCX : minCY;
+    float axisExtent = splitX ? (maxCX - minCX) : (maxCY - minCY);
+
+    auto center = [splitX](const BuildProxy &proxy)
     {
+        return splitX ? proxy.centerX : proxy.centerY;
+    };
+
+    BuildProxy *mid = nullptr;
+
+    if (axisExtent > 0.f)
+    {
+        constexpr int BinCount = 16;
+
+        struct Bin
+        {
+            AABB aabb;
+            uint32_t count = 0;
+        };
+
+        Bin bins[BinCount];
+        float scale = BinCount / axisExtent;
+
+        auto binOf = [&](const BuildProxy &proxy)
+        {
+            int bin = static_cast<int>((center(proxy) - axisMin) * scale);
+            return std::min(bin, BinCount - 1);
+        };
+
+        for (BuildProxy *it = begin; it != end; ++it)
+        {
+            Bin &bin = bins[binOf(*it)];
+            bin.aabb = bin.count ? AABBUnion(bin.aabb, it->aabb) : it->aabb;
+            ++bin.count;
+        }
+
+        // Sweep from the right to get the cost of every right side
+        float rightArea[BinCount];
+        uint32_t rightCount[BinCount];
+        AABB accumulated{};
+        uint32_t accumulatedCount = 0;
+
+        for (int i = BinCount - 1; i > 0; --i)
+        {
+            if (bins[i].count)
+            {
+                accumulated = accumulatedCount ? AABBUnion(accumulated, bins[i].aabb) : bins[i].aabb;
+                accumulatedCount += bins[i].count;
+            }
+
+            rightArea[i] = accumulatedCount ? GetAreaAABB(accumulated) : 0.f;
+            rightCount[i] = accumulatedCount;
+        }
+
+        int bestSplit = -1;
+        float bestCost = std::numeric_limits<float>::max();
+        accumulatedCount = 0;
+
+        for (int i = 0; i < BinCount - 1; ++i)
+        {
+            if (bins[i].count)
+            {
+                accumulated = accumulatedCount ? AABBUnion(accumulated, bins[i].aabb) : bins[i].aabb;
+                accumulatedCount += bins[i].count;
+            }
+
+            if (!accumulatedCount || !rightCount[i + 1])
+                continue;
+
+            float cost = GetAreaAABB(accumulated) * accumulatedCount + rightArea[i + 1] * rightCount[i + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = i;
+            }
+        }
+
+        if (bestSplit >= 0)
+        {
+            mid = std::partition(begin, end, [&](const BuildProxy &proxy)
+                                 { return binOf(proxy) <= bestSplit; });
+        }
+    }
+
+    // Every center in one spot, fall back to a median split
+    if (!mid || mid == begin || mid == end)
+    {
+        mid = begin + count / 2;
+        std::nth_element(begin, mid, end, [&](const BuildProxy &a, const BuildProxy &b)
+                         { return center(a) < center(b); });
+    }
+
+    uint32_t child0 = BuildRange(begin, mid);
+    uint32_t child1 = BuildRange(mid, end);
+
+    uint32_t node = AllocateNode();
+    Node &n = nodes[node];
+
+    n.children[0] = child0;
+    n.children[1] = child1;
+    n.aabb = AABBUnion(nodes[child0].aabb, nodes[child1].aabb);
+    n.collisionMask = nodes[child0].collisionMask | nodes[child1].collisionMask;
+    n.height = 1 + std::max(nodes[child0].height, nodes[child1].height);
+
+    nodes[child0].parent = node;
+    nodes[child1].parent = node;
+
+    return node;
+}
+
+namespace
+{
+    // Splits [0, count) into threadCount contiguous chunks, work(thread, begin, end)
+    // Chunk boundaries only depend on count and threadCount
+    template <typename F>
+    void ParallelFor(uint32_t threadCount, size_t count, const F &work)
+    {
+        size_t chunk = (count + threadCount - 1) / threadCount;
+
+        std::vector<std::thread> threads;
+        threads.reserve(threadCount - 1);
+
+        for (uint32_t t = 1; t < threadCount; ++t)
+        {
+            size_t begin = std::min(count, t * chunk);
+            size_t end = std::min(count, begin + chunk);
+            threads.emplace_back(work, t, begin, end);
+        }
+
+        work(0u, size_t{0}, std::min(count, chunk));
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // 16 bits per axis
+    uint32_t SpreadBits(uint32_t v)
+    {
+        v &= 0x0000FFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+} // namespace
+
+// Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+// Leaves sorted by Morton code take nodes [0, n), internal node i takes n + i
+// Every internal node finds its own range and split, so all of them are built at once
+void sas::AABBTree::BuildParallel(std::span<const TreeProxy> proxies, uint32_t threadCount, bool markMoved) noexcept
+{
+    const size_t n = proxies.size();
+
+    if (n < 2)
+    {
+        Build(proxies, markMoved);
         return;
     }
 
-    if (node->isLeaf())
+    if (threadCount == 0)
     {
-        results.push_back(node->objectID);
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
     }
-    else
+    threadCount = static_cast<uint32_t>(std::min<size_t>(threadCount, n));
+
+    // Bounds of the centers
+    std::vector<AABB> threadBounds(threadCount, AABB{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                                                     std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()});
+
+    ParallelFor(threadCount, n, [&](uint32_t t, size_t begin, size_t end)
+                {
+                    AABB bounds = threadBounds[t];
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const AABB &aabb = proxies[i].second;
+                        float cx = (aabb.minX + aabb.maxX) * 0.5f;
+                        float cy = (aabb.minY + aabb.maxY) * 0.5f;
+
+                        bounds.minX = std::min(bounds.minX, cx);
+                        bounds.minY = std::min(bounds.minY, cy);
+                        bounds.maxX = std::max(bounds.maxX, cx);
+                        bounds.maxY = std::max(bounds.maxY, cy);
+                    }
+                    threadBounds[t] = bounds; });
+
+    AABB centers = threadBounds[0];
+    for (const AABB &bounds : threadBounds)
+    {
+        centers = AABBUnion(centers, bounds);
+    }
+
+    float scaleX = (centers.maxX > centers.minX) ? 65535.f / (centers.maxX - centers.minX) : 0.f;
+    float scaleY = (centers.maxY > centers.minY) ? 65535.f / (centers.maxY - centers.minY) : 0.f;
+
+    std::vector<uint32_t> keys(n), keysTmp(n);
+    std::vector<uint32_t> order(n), orderTmp(n);
+
+    ParallelFor(threadCount, n, [&](uint32_t, size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const AABB &aabb = proxies[i].second;
+                        float cx = (aabb.minX + aabb.maxX) * 0.5f;
+                        float cy = (aabb.minY + aabb.maxY) * 0.5f;
+
+                        uint32_t qx = static_cast<uint32_t>((cx - centers.minX) * scaleX);
+                        uint32_t qy = static_cast<uint32_t>((cy - centers.minY) * scaleY);
+
+                        keys[i] = SpreadBits(qx) | (SpreadBits(qy) << 1);
+                        order[i] = static_cast<uint32_t>(i);
+                    } });
+
+    // LSD radix sort, 8 bits per pass, stable so equal codes keep the input order
+    std::vector<uint32_t> histograms(threadCount * 256);
+
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        std::fill(histograms.begin(), histograms.end(), 0);
+
+        ParallelFor(threadCount, n, [&](uint32_t t, size_t begin, size_t end)
+                    {
+                        uint32_t *histogram = &histograms[t * 256];
+                        for (size_t i = begin; i < end; ++i)
+                            ++histogram[(keys[i] >> shift) & 0xFF]; });
+
+        // Bucket major, thread minor, so thread t writes after threads < t in every bucket
+        uint32_t offset = 0;
+        for (uint32_t bucket = 0; bucket < 256; ++bucket)
+        {
+            for (uint32_t t = 0; t < threadCount; ++t)
+            {
+                uint32_t count = histograms[t * 256 + bucket];
+                histograms[t * 256 + bucket] = offset;
+                offset += count;
+            }
+        }
+
+        ParallelFor(threadCount, n, [&](uint32_t t, size_t begin, size_t end)
+                    {
+                        uint32_t *offsets = &histograms[t * 256];
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            uint32_t destination = offsets[(keys[i] >> shift) & 0xFF]++;
+                            keysTmp[destination] = keys[i];
+                            orderTmp[destination] = order[i];
+                        } });
+
+        keys.swap(keysTmp);
+        order.swap(orderTmp);
+    }
+
+    // Fresh default nodes, the passes below only fill in their own fields
+    nodes.clear();
+    nodes.resize(2 * n - 1);
+    freeList = NullNode;
+    leafMap.clear();
+
+    ParallelFor(threadCount, n, [&](uint32_t, size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const TreeProxy &proxy = proxies[order[i]];
+
+                        Node &leaf = nodes[i];
+                        leaf.aabb = proxy.second;
+                        leaf.objectID = static_cast<int>(proxy.first);
+                        leaf.collisionMask = GetCollisionMask(proxy.first);
+                    } });
+
+    const int count = static_cast<int>(n);
+
+    // Length of the common prefix of codes i and j, equal codes fall back to the indices
+    auto delta = [&](int i, int j) -> int
+    {
+        if (j < 0 || j >= count)
+            return -1;
+
+        if (keys[i] == keys[j])
+            return 32 + std::countl_zero(static_cast<uint32_t>(i ^ j));
+
+        return std::countl_zero(keys[i] ^ keys[j]);
+    };
+
+    ParallelFor(threadCount, n - 1, [&](uint32_t, size_t begin, size_t end)
+                {
+                    for (size_t index = begin; index < end; ++index)
+                    {
+                        int i = static_cast<int>(index);
+
+                        // Direction of the range
+                        int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+                        int deltaMin = delta(i, i - d);
+
+                        int lengthMax = 2;
+                        while (delta(i, i + lengthMax * d) > deltaMin)
+                            lengthMax *= 2;
+
+                        int length = 0;
+                        for (int t = lengthMax / 2; t >= 1; t /= 2)
+                        {
+                            if (delta(i, i + (length + t) * d) > deltaMin)
+                                length += t;
+                        }
+
+                        int j = i + length * d;
+                        int deltaNode = delta(i, j);
+
+                        // Binary search for the split
+                        int split = 0;
+                        int t = length;
+                        do
+                        {
+                            t = (t + 1) >> 1;
+                            if (delta(i, i + (split + t) * d) > deltaNode)
+                                split += t;
+                        } while (t > 1);
+
+                        int gamma = i + split * d + std::min(d, 0);
+
+                        uint32_t self = static_cast<uint32_t>(n + i);
+                        uint32_t left = (std::min(i, j) == gamma) ? static_cast<uint32_t>(gamma) : static_cast<uint32_t>(n + gamma);
+                        uint32_t right = (std::max(i, j) == gamma + 1) ? static_cast<uint32_t>(gamma + 1) : static_cast<uint32_t>(n + gamma + 1);
+
+                        // Parent links are written by other threads, only touch the children
+                        Node &node = nodes[self];
+                        node.children[0] = left;
+                        node.children[1] = right;
+
+                        nodes[left].parent = self;
+                        nodes[right].parent = self;
+                    } });
+
+    root = static_cast<uint32_t>(n);
+    nodes[root].parent = NullNode;
+
+    // Boxes bottom up, the second child to arrive at a node fills it in
+    std::vector<std::atomic<uint32_t>> arrivals(n - 1);
+
+    ParallelFor(threadCount, n, [&](uint32_t, size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        uint32_t walk = nodes[i].parent;
+
+                        while (walk != NullNode)
+                        {
+                            if (arrivals[walk - n].fetch_add(1, std::memory_order_acq_rel) == 0)
+                                break;
+
+                            Node &node = nodes[walk];
+                            const Node &child0 = nodes[node.children[0]];
+                            const Node &child1 = nodes[node.children[1]];
+
+                            node.aabb = AABBUnion(child0.aabb, child1.aabb);
+                            node.collisionMask = child0.collisionMask | child1.collisionMask;
+                            node.height = 1 + std::max(child0.height, child1.height);
+
+                            walk = node.parent;
+                        }
+                    } });
+
+    uint32_t maxID = 0;
+    for (const TreeProxy &proxy : proxies)
     {
-        Query(node->children[0], targetAABB, results);
-        Query(node->children[1], targetAABB, results);
+        maxID = std::max(maxID, proxy.first);
+
+        if (markMoved)
+            moveBuffer.push_back(proxy.first);
     }
+
+    // Every id appears once, so the threads write disjoint slots
+    leafMap.resize(maxID + 1, NullNode);
+
+    ParallelFor(threadCount, n, [&](uint32_t, size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                        leafMap[static_cast<uint32_t>(nodes[i].objectID)] = static_cast<uint32_t>(i); });
+}
+
+void sas::AABBTree::GetProxies(std::vector<TreeProxy> &proxies) const
+{
+    for (uint32_t id = 0; id < leafMap.size(); ++id)
+    {
+        if (leafMap[id] != NullNode)
+            proxies.emplace_back(id, nodes[leafMap[id]].aabb);
+    }
+}
+
+uint32_t sas::AABBTree::FindSiblingGreedy(const AABB &aabb) const noexcept
+{
+    uint32_t sibling = root;
+    while (!nodes[sibling].isLeaf())
+    {
+        const Node &node = nodes[sibling];
+        float area0 = GetAreaAABB(AABBUnion(nodes[node.children[0]].aabb, aabb));
+        float area1 = GetAreaAABB(AABBUnion(nodes[node.children[1]].aabb, aabb));
+
+        if (area0 < area1)
+            sibling = node.children[0];
+        else
+            sibling = node.children[1];
+    }
+
+    return sibling;
+}
+
+// Pairing the leaf with a node costs the area of their union plus the
+// growth of every ancestor above it (the inherited cost). The inherited
+// cost only grows on the way down, so a subtree can be skipped once
+// leaf area + inherited cost is no better than the best sibling so far
+uint32_t sas::AABBTree::FindSiblingBranchAndBound(const AABB &aabb) noexcept
+{
+    const float leafArea = GetAreaAABB(aabb);
+
+    auto cheaper = [](const SiblingCandidate &a, const SiblingCandidate &b)
+    {
+        return a.inheritedCost > b.inheritedCost;
+    };
+
+    uint32_t bestSibling = root;
+    float bestCost = GetAreaAABB(AABBUnion(nodes[root].aabb, aabb));
+
+    siblingHeap.clear();
+    siblingHeap.push_back({root, 0.f});
+
+    while (!siblingHeap.empty())
+    {
+        std::pop_heap(siblingHeap.begin(), siblingHeap.end(), cheaper);
+        SiblingCandidate candidate = siblingHeap.back();
+        siblingHeap.pop_back();
+
+        if (candidate.inheritedCost + leafArea >= bestCost)
+            continue;
+
+        const Node &node = nodes[candidate.node];
+
+        float directCost = GetAreaAABB(AABBUnion(node.aabb, aabb));
+        float cost = directCost + candidate.inheritedCost;
+
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestSibling = candidate.node;
+        }
+
+        if (node.isLeaf())
+            continue;
+
+        float childInherited = candidate.inheritedCost + directCost - GetAreaAABB(node.aabb);
+
+        if (childInherited + leafArea < bestCost)
+        {
+            siblingHeap.push_back({node.children[0], childInherited});
+            std::push_heap(siblingHeap.begin(), siblingHeap.end(), cheaper);
+
+            siblingHeap.push_back({node.children[1], childInherited});
+            std::push_heap(siblingHeap.begin(), siblingHeap.end(), cheaper);
+        }
+    }
+
+    return bestSibling;
+}
+
+void sas::AABBTree::RefitAncestors(uint32_t node) noexcept
+{
+    uint32_t walk = node;
+    while (walk != NullNode)
+    {
+        walk = Balance(walk);
+
+        Node &n = nodes[walk];
+        const Node &child0 = nodes[n.children[0]];
+        const Node &child1 = nodes[n.children[1]];
+
+        n.height = 1 + std::max(child0.height, child1.height);
+        n.aabb = AABBUnion(child0.aabb, child1.aabb);
+        n.collisionMask = child0.collisionMask | child1.collisionMask;
+
+        walk = n.parent;
+    }
+}
+
+// Same rotation scheme as a classic AVL tree, except that the
+// grandchild that goes up is the taller one so that boxes stay tight
+uint32_t sas::AABBTree::Balance(uint32_t iA) noexcept
+{
+    Node &A = nodes[iA];
+    if (A.isLeaf() || A.height < 2)
+    {
+        return iA;
+    }
+
+    uint32_t iB = A.children[0];
+    uint32_t iC = A.children[1];
+    Node &B = nodes[iB];
+    Node &C = nodes[iC];
+
+    int balance = C.height - B.height;
+
+    // Rotate C up
+    if (balance > 1)
+    {
+        uint32_t iF = C.children[0];
+        uint32_t iG = C.children[1];
+        Node &F = nodes[iF];
+        Node &G = nodes[iG];
+
+        C.children[0] = iA;
+        C.parent = A.parent;
+        A.parent = iC;
+
+        if (C.parent != NullNode)
+        {
+            Node &P = nodes[C.parent];
+            if (P.children[0] == iA)
+                P.children[0] = iC;
+            else
+                P.children[1] = iC;
+        }
+        else
+        {
+            root = iC;
+        }
+
+        if (F.height > G.height)
+        {
+            C.children[1] = iF;
+            A.children[1] = iG;
+            G.parent = iA;
+            A.aabb = AABBUnion(B.aabb, G.aabb);
+            C.aabb = AABBUnion(A.aabb, F.aabb);
+            A.collisionMask = B.collisionMask | G.collisionMask;
+            C.collisionMask = A.collisionMask | F.collisionMask;
+
+            A.height = 1 + std::max(B.height, G.height);
+            C.height = 1 + std::max(A.height, F.height);
+        }
+        else
+        {
+            C.children[1] = iG;
+            A.children[1] = iF;
+            F.parent = iA;
+            A.aabb = AABBUnion(B.aabb, F.aabb);
+            C.aabb = AABBUnion(A.aabb, G.aabb);
+            A.collisionMask = B.collisionMask | F.collisionMask;
+            C.collisionMask = A.collisionMask | G.collisionMask;
+
+            A.height = 1 + std::max(B.height, F.height);
+            C.height = 1 + std::max(A.height, G.height);
+        }
+
+        return iC;
+    }
+
+    // Rotate B up
+    if (balance < -1)
+    {
+        uint32_t iD = B.children[0];
+        uint32_t iE = B.children[1];
+        Node &D = nodes[iD];
+        Node &E = nodes[iE];
+
+        B.children[0] = iA;
+        B.parent = A.parent;
+        A.parent = iB;
+
+        if (B.parent != NullNode)
+        {
+            Node &P = nodes[B.parent];
+            if (P.children[0] == iA)
+                P.children[0] = iB;
+            else
+                P.children[1] = iB;
+        }
+        else
+        {
+            root = iB;
+        }
+
+        if (D.height > E.height)
+        {
+            B.children[1] = iD;
+            A.children[0] = iE;
+            E.parent = iA;
+            A.aabb = AABBUnion(C.aabb, E.aabb);
+            B.aabb = AABBUnion(A.aabb, D.aabb);
+            A.collisionMask = C.collisionMask | E.collisionMask;
+            B.collisionMask = A.collisionMask | D.collisionMask;
+
+            A.height = 1 + std::max(C.height, E.height);
+            B.height = 1 + std::max(A.height, D.height);
+        }
+        else
+        {
+            B.children[1] = iE;
+            A.children[0] = iD;
+            D.parent = iA;
+            A.aabb = AABBUnion(C.aabb, D.aabb);
+            B.aabb = AABBUnion(A.aabb, E.aabb);
+            A.collisionMask = C.collisionMask | D.collisionMask;
+            B.collisionMask = A.collisionMask | E.collisionMask;
+
+            A.height = 1 + std::max(C.height, D.height);
+            B.height = 1 + std::max(A.height, E.height);
+        }
+
+        return iB;
+    }
+
+    return iA;
+}
+
+int sas::AABBTree::GetHeight() const noexcept
+{
+    if (root == NullNode)
+        return 0;
+
+    return nodes[root].height;
+}
+
+int sas::AABBTree::GetMaxBalance() const noexcept
+{
+    int maxBalance = 0;
+    for (const Node &node : nodes)
+    {
+        if (node.height <= 1)
+            continue;
+
+        int balance = std::abs(nodes[node.children[1]].height - nodes[node.children[0]].height);
+        maxBalance = std::max(maxBalance, balance);
+    }
+
+    return maxBalance;
 }
 
 void sas::AABBTree::Query(const AABB &targetAABB, std::vector<uint32_t> &results) const noexcept
 {
-    Query(root, targetAABB, results);
+    QueryVisit(targetAABB, [&results](uint32_t id)
+               { results.push_back(id); });
+}
+
+void sas::AABBTree::FindAllPairs(std::vector<BroadPair> &pairs) const noexcept
+{
+    if (root != NullNode)
+    {
+        SelfPairs(root, pairs);
+    }
+}
+
+// Pairs inside a subtree are the pairs inside each child
+// plus the pairs that straddle the two children
+void sas::AABBTree::SelfPairs(uint32_t node, std::vector<BroadPair> &pairs) const noexcept
+{
+    const Node &n = nodes[node];
+    if (n.isLeaf() || !CanCollide(n.collisionMask, n.collisionMask))
+        return;
+
+    SelfPairs(n.children[0], pairs);
+    SelfPairs(n.children[1], pairs);
+    CrossPairs(n.children[0], n.children[1], pairs);
+}
+
+void sas::AABBTree::CrossPairs(uint32_t nodeA, uint32_t nodeB, std::vector<BroadPair> &pairs) const noexcept
+{
+    const Node &a = nodes[nodeA];
+    const Node &b = nodes[nodeB];
+
+    if (!AABBOverlap(a.aabb, b.aabb) || !CanCollide(a.collisionMask, b.collisionMask))
+        return;
+
+    if (a.isLeaf() && b.isLeaf())
+    {
+        uint32_t idA = static_cast<uint32_t>(a.objectID);
+        uint32_t idB = static_cast<uint32_t>(b.objectID);
+
+        pairs.push_back({std::min(idA, idB), std::max(idA, idB)});
+        return;
+    }
+
+    // Descend into the bigger box so both sides shrink at a similar rate
+    if (b.isLeaf() || (!a.isLeaf() && GetAreaAABB(a.aabb) >= GetAreaAABB(b.aabb)))
+    {
+        CrossPairs(a.children[0], nodeB, pairs);
+        CrossPairs(a.children[1], nodeB, pairs);
+    }
+    else
+    {
+        CrossPairs(nodeA, b.children[0], pairs);
+        CrossPairs(nodeA, b.children[1], pairs);
+    }
 }
 
-void sas::AABBTree::remove(Node *leaf) noexcept
+void sas::AABBTree::removeLeaf(uint32_t leaf) noexcept
 {
     if (leaf == root)
     {
-        root = nullptr;
+        root = NullNode;
         return;
     }
 
-    Node *parent = leaf->parent;
-    Node *grandParent = parent->parent;
+    uint32_t parent = nodes[leaf].parent;
+    uint32_t grandParent = nodes[parent].parent;
 
-    Node *sibling = (parent->children[0] == leaf) ? parent->children[1] : parent->children[0];
+    uint32_t sibling = (nodes[parent].children[0] == leaf) ? nodes[parent].children[1] : nodes[parent].children[0];
 
-    if (grandParent)
+    if (grandParent != NullNode)
     {
-        if (grandParent->children[0] == parent)
-            grandParent->children[0] = sibling;
+        if (nodes[grandParent].children[0] == parent)
+            nodes[grandParent].children[0] = sibling;
         else
-            grandParent->children[1] = sibling;
+            nodes[grandParent].children[1] = sibling;
 
-        sibling->parent = grandParent;
-        delete parent;
+        nodes[sibling].parent = grandParent;
+        FreeNode(parent);
 
-        Node *walk = grandParent;
-        while (walk)
-        {
-            walk->aabb = AABBUnion(walk->children[0]->aabb, walk->children[1]->aabb);
-            walk = walk->parent;
-        }
+        RefitAncestors(grandParent);
     }
     else
     {
         root = sibling;
-        sibling->parent = nullptr;
-        delete parent;
+        nodes[sibling].parent = NullNode;
+        FreeNode(parent);
     }
 }
 
 void sas::AABBTree::remove(uint32_t id) noexcept
 {
-    Node *leaf = leafMap[id];
-    remove(leaf);
+    if (!Contains(id))
+        return;
 
-    leafMap.erase(id);
+    uint32_t leaf = leafMap[id];
+    removeLeaf(leaf);
+
+    leafMap[id] = NullNode;
+
+    FreeNode(leaf);
+}
+
+bool sas::AABBTree::Contains(uint32_t id) const noexcept
+{
+    return id < leafMap.size() && leafMap[id] != NullNode;
+}
 
-    delete leaf;
+const sas::AABB &sas::AABBTree::GetFatAABB(uint32_t id) const noexcept
+{
+    return nodes[leafMap[id]].aabb;
 }
 
 void sas::AABBTree::UpdateObject(const Body &body, float margin) noexcept
 {
+    AABB tight = ComputeTightAABB(body);
+
+    UpdateObject(body.bodyID, tight, ComputeSweptAABB(tight, {0, 0}, margin));
+}
+
+void sas::AABBTree::UpdateObject(uint32_t bodyID, const AABB &tight, const AABB &fat) noexcept
+{
+    if (!Contains(bodyID))
+        return;
+
+    uint32_t leaf = leafMap[bodyID];
+    const AABB &cur = nodes[leaf].aabb;
+    if (AABBContains(cur, tight))
+        return;
+
+    bool refit = (updateMode == UpdateMode::Refit);
+    if (updateMode == UpdateMode::Adaptive)
+    {
+        float oldArea = GetAreaAABB(cur);
+        float grownArea = GetAreaAABB(AABBUnion(cur, fat));
 
-    AABB actual = ComputeTightAABB(body);
+        refit = grownArea <= oldArea * (1.f + refitGrowthLimit);
+    }
+
+    if (refit)
+    {
+        // Keeps the leaf where it is, only the boxes above it change
+        nodes[leaf].aabb = fat;
+        RefitAncestors(nodes[leaf].parent);
+        moveBuffer.push_back(bodyID);
 
-    Node *curNode = leafMap[body.bodyID];
-    if (actual.minX < curNode->aabb.minX || actual.maxX > curNode->aabb.maxX ||
-        actual.minY < curNode->aabb.minY || actual.maxY > curNode->aabb.maxY)
+        ++updateStats.refits;
+    }
+    else
     {
+        remove(bodyID);
+        insert(bodyID, fat);
 
-        remove(body.bodyID);
-        insert(body.bodyID, ComputeFatAABB(body, margin));
+        ++updateStats.reinserts;
     }
 }
 
-void sas::AABBTree::Clear(Node *node) noexcept
+void sas::AABBTree::Optimize(uint32_t nodeBudget) noexcept
 {
-    if (!node)
+    // Nodes looked at per node moved
+    constexpr size_t WindowPerNode = 16;
+
+    if (nodeBudget == 0 || root == NullNode || nodes[root].isLeaf())
         return;
 
-    Clear(node->children[0]);
-    Clear(node->children[1]);
+    if (optimizeCursor >= nodes.size())
+        optimizeCursor = 0;
+
+    size_t window = std::min(nodes.size(), nodeBudget * WindowPerNode);
+
+    optimizeCandidates.clear();
+    for (size_t k = 0; k < window; ++k)
+    {
+        uint32_t index = optimizeCursor;
+        optimizeCursor = (optimizeCursor + 1) % static_cast<uint32_t>(nodes.size());
+
+        const Node &n = nodes[index];
+
+        // Free nodes, leaves and the root itself can not be moved
+        if (n.height <= 0 || index == root)
+            continue;
 
-    delete node;
+        // Big nodes whose children fill little of them, the m_comb measure of the paper
+        double area = GetAreaAABB(n.aabb);
+        double area0 = GetAreaAABB(nodes[n.children[0]].aabb);
+        double area1 = GetAreaAABB(nodes[n.children[1]].aabb);
+
+        double cost = area * (area / std::max(std::min(area0, area1), 1e-6)) * (area / std::max(area0 + area1, 1e-6));
+
+        optimizeCandidates.push_back({index, cost});
+    }
+
+    size_t count = std::min<size_t>(nodeBudget, optimizeCandidates.size());
+    std::partial_sort(optimizeCandidates.begin(), optimizeCandidates.begin() + count, optimizeCandidates.end(),
+                      [](const OptimizeCandidate &a, const OptimizeCandidate &b)
+                      { return a.cost > b.cost; });
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t node = optimizeCandidates[i].node;
+
+        // An earlier reinsertion freed it, or it became the root
+        if (nodes[node].height <= 0 || node == root)
+            continue;
+
+        uint32_t child0 = nodes[node].children[0];
+        uint32_t child1 = nodes[node].children[1];
+
+        removeLeaf(node);
+        FreeNode(node);
+
+        // Always the full search, a greedy descent would undo what the optimization is for
+        InsertSubtree(child0, InsertStrategy::BranchAndBound);
+        InsertSubtree(child1, InsertStrategy::BranchAndBound);
+
+        ++updateStats.optimized;
+    }
 }
 
-void sas::Node::Draw(const DrawCallback &cb) const
+float sas::AABBTree::GetSAHCost() const noexcept
 {
-    cb(aabb, isLeaf());
+    if (root == NullNode)
+        return 0.f;
+
+    float rootArea = GetAreaAABB(nodes[root].aabb);
+    if (rootArea <= 0.f)
+        return 0.f;
+
+    double internalArea = 0.0;
+    for (const Node &n : nodes)
+    {
+        if (n.height > 0)
+            internalArea += GetAreaAABB(n.aabb);
+    }
 
-    if (children[0])
-        children[0]->Draw(cb);
-    if (children[1])
-        children[1]->Draw(cb);
+    return static_cast<float>(internalArea / rootArea);
+}
+
+void sas::AABBTree::Draw(uint32_t node, const DrawCallback &cb) const
+{
+    const Node &n = nodes[node];
+    cb(n.aabb, n.isLeaf());
+
+    if (!n.isLeaf())
+    {
+        Draw(n.children[0], cb);
+        Draw(n.children[1], cb);
+    }
 }
 
 void sas::AABBTree::Draw(const DrawCallback &cb) const
 {
-    if (root != nullptr)
+    if (root != NullNode)
     {
-        root->Draw(cb);
+        Draw(root, cb);
     }
 }
 
 void sas::AABBTree::Clear() noexcept
 {
-    Clear(root);
-    root = nullptr;
+    nodes.clear();
+    freeList = NullNode;
+    root = NullNode;
     leafMap.clear();
+    collisionMasks.clear();
+    moveBuffer.clear();
 }
@@ -0,0 +1,280 @@
+#include "HierarchicalGrid.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+void sas::HierarchicalGrid::SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept
+{
+    if (bodyID >= proxySlots.size())
+    {
+        proxySlots.resize(bodyID + 1, NullNode);
+    }
+
+    if (proxySlots[bodyID] == NullNode)
+    {
+        proxySlots[bodyID] = static_cast<uint32_t>(proxies.size());
+        proxies.push_back({aabb, 0, 0, bodyID, collisionMask, 0});
+        return;
+    }
+
+    CellEntry &proxy = proxies[proxySlots[bodyID]];
+    proxy.aabb = aabb;
+    proxy.collisionMask = collisionMask;
+}
+
+void sas::HierarchicalGrid::RemoveProxy(uint32_t bodyID) noexcept
+{
+    if (!Contains(bodyID))
+        return;
+
+    uint32_t slot = proxySlots[bodyID];
+    proxies[slot] = proxies.back();
+    proxySlots[proxies[slot].bodyID] = slot;
+
+    proxies.pop_back();
+    proxySlots[bodyID] = NullNode;
+}
+
+void sas::HierarchicalGrid::Build(float minCellSize) noexcept
+{
+    unsorted.clear();
+    entryBuckets.clear();
+    oversized.clear();
+    gridProxies.clear();
+
+    float cellSize = minCellSize;
+    for (Level &level : levels)
+    {
+        level = {};
+        level.cellSize = cellSize;
+        level.invCellSize = 1.f / cellSize;
+        cellSize *= LevelScale;
+    }
+
+    bounds = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+
+    for (const CellEntry &proxy : proxies)
+    {
+        const AABB &aabb = proxy.aabb;
+
+        float width = aabb.maxX - aabb.minX, height = aabb.maxY - aabb.minY;
+        float extent = std::max(width, height);
+
+        if (extent * levels[MaxLevels - 1].invCellSize > 1.f)
+        {
+            oversized.push_back({aabb, 0, 0, proxy.bodyID, proxy.collisionMask, MaxLevels});
+            continue;
+        }
+
+        int index = 0;
+        while (extent * levels[index].invCellSize > 1.f)
+            ++index;
+
+        Level &level = levels[index];
+        ++level.count;
+        level.collisionMask |= proxy.collisionMask;
+        level.sumWidth += width;
+        level.sumHeight += height;
+
+        bounds = AABBUnion(bounds, aabb);
+
+        unsorted.push_back({aabb, CellCoord(aabb.minX, index), CellCoord(aabb.minY, index),
+                            proxy.bodyID, proxy.collisionMask, index});
+    }
+
+    uint32_t bucketCount = std::bit_ceil(static_cast<uint32_t>(std::max<size_t>(unsorted.size() * 2, 16)));
+    bucketMask = bucketCount - 1;
+    bucketStart.assign(bucketCount + 1, 0);
+
+    // Levels start at scattered offsets so their busy rows do not pile up in the same buckets
+    for (int i = 0; i < MaxLevels && !unsorted.empty(); ++i)
+    {
+        Level &level = levels[i];
+
+        float columns = std::min((bounds.maxX - bounds.minX) * level.invCellSize + 2.f, static_cast<float>(bucketCount));
+        level.rowPitch = static_cast<uint32_t>(columns) + 1;
+        level.bucketOffset = static_cast<uint32_t>(i) * 0x9E3779B1u;
+    }
+
+    entryBuckets.reserve(unsorted.size());
+    for (const CellEntry &entry : unsorted)
+    {
+        entryBuckets.push_back(Bucket(entry.cellX, entry.cellY, entry.level));
+        ++bucketStart[entryBuckets.back()];
+    }
+
+    uint32_t total = 0;
+    for (uint32_t b = 0; b < bucketCount; ++b)
+    {
+        total += bucketStart[b];
+        bucketStart[b] = total;
+    }
+    bucketStart[bucketCount] = total;
+
+    // Same back to front fill as SpatialHashGrid
+    entries.resize(unsorted.size());
+    for (size_t i = 0; i < unsorted.size(); ++i)
+    {
+        entries[--bucketStart[entryBuckets[i]]] = unsorted[i];
+    }
+
+    uint32_t first = 0;
+    uint32_t cursor[MaxLevels];
+    for (int i = 0; i < MaxLevels; ++i)
+    {
+        levels[i].first = first;
+        cursor[i] = first;
+        first += levels[i].count;
+    }
+
+    levelOrder.resize(entries.size());
+    for (uint32_t i = 0; i < entries.size(); ++i)
+    {
+        levelOrder[cursor[entries[i].level]++] = i;
+    }
+
+    if (oversized.empty())
+        return;
+
+    gridProxies = entries;
+
+    auto byMinX = [](const CellEntry &a, const CellEntry &b)
+    { return a.aabb.minX < b.aabb.minX; };
+
+    std::sort(oversized.begin(), oversized.end(), byMinX);
+    std::sort(gridProxies.begin(), gridProxies.end(), byMinX);
+}
+
+// Bodies on the target level are spread evenly over the bounds as far as the estimate goes,
+// so a level of few but long bodies (platforms) counts as crowded cells
+float sas::HierarchicalGrid::QueryCost(int from, int to) const noexcept
+{
+    const Level &source = levels[from];
+    const Level &target = levels[to];
+
+    float count = static_cast<float>(source.count);
+    float cellsX = source.sumWidth / count * target.invCellSize + 2.f;
+    float cellsY = source.sumHeight / count * target.invCellSize + 2.f;
+
+    float area = std::max(GetAreaAABB(bounds), target.cellSize * target.cellSize);
+    float perCell = static_cast<float>(target.count) * target.cellSize * target.cellSize / area;
+
+    return count * cellsX * cellsY * (1.f + perCell);
+}
+
+// A partner's min corner is at most one cell before the body's, so the body's box
+// widened by one cell on the min side holds the cells to look at
+void sas::HierarchicalGrid::QueryLevel(int from, int to, std::vector<BroadPair> &pairs) const noexcept
+{
+    const Level &source = levels[from];
+    const Level &target = levels[to];
+
+    for (uint32_t order = source.first; order < source.first + source.count; ++order)
+    {
+        const CellEntry &entry = entries[levelOrder[order]];
+        if (!CanCollide(entry.collisionMask, target.collisionMask))
+            continue;
+
+        int32_t minX = CellCoord(entry.aabb.minX, to) - 1, maxX = CellCoord(entry.aabb.maxX, to);
+        int32_t minY = CellCoord(entry.aabb.minY, to) - 1, maxY = CellCoord(entry.aabb.maxY, to);
+
+        for (int32_t y = minY; y <= maxY; ++y)
+        {
+            for (int32_t x = minX; x <= maxX; ++x)
+            {
+                uint32_t bucket = Bucket(x, y, to);
+
+                for (uint32_t i = bucketStart[bucket]; i < bucketStart[bucket + 1]; ++i)
+                {
+                    const CellEntry &other = entries[i];
+                    if (other.cellX != x || other.cellY != y || other.level != to)
+                        continue;
+
+                    // Both bodies of a level see each other, the lower id reports
+                    if (from == to && other.bodyID <= entry.bodyID)
+                        continue;
+
+                    if (AABBOverlap(entry.aabb, other.aabb) && CanCollide(entry.collisionMask, other.collisionMask))
+                        pairs.push_back({std::min(entry.bodyID, other.bodyID), std::max(entry.bodyID, other.bodyID)});
+                }
+            }
+        }
+    }
+}
+
+// Every pair of levels whose layers can collide is checked once, from whichever side is cheaper.
+// Usually the small bodies look up the few coarse cells around them, but a coarse level crowded
+// with long platforms is cheaper to scan over the fine cells its bodies cover
+void sas::HierarchicalGrid::FindAllPairs(std::vector<BroadPair> &pairs) const noexcept
+{
+    for (int fine = 0; fine < MaxLevels; ++fine)
+    {
+        if (!levels[fine].count)
+            continue;
+
+        for (int coarse = fine; coarse < MaxLevels; ++coarse)
+        {
+            if (!levels[coarse].count || !CanCollide(levels[fine].collisionMask, levels[coarse].collisionMask))
+                continue;
+
+            if (coarse != fine && QueryCost(coarse, fine) < QueryCost(fine, coarse))
+                QueryLevel(coarse, fine, pairs);
+            else
+                QueryLevel(fine, coarse, pairs);
+        }
+    }
+
+    auto test = [&pairs](const CellEntry &a, const CellEntry &b)
+    {
+        if (AABBOverlap(a.aabb, b.aabb) && CanCollide(a.collisionMask, b.collisionMask))
+            pairs.push_back({std::min(a.bodyID, b.bodyID), std::max(a.bodyID, b.bodyID)});
+    };
+
+    auto minXBelow = [](const CellEntry &e, float x)
+    { return e.aabb.minX < x; };
+    auto minXAbove = [](float x, const CellEntry &e)
+    { return x < e.aabb.minX; };
+
+    // Same sweep as SpatialHashGrid, each pair is found from the box whose minX is lower,
+    // ties go to the oversized one
+    for (size_t i = 0; i < oversized.size(); ++i)
+    {
+        const CellEntry &a = oversized[i];
+
+        for (size_t j = i + 1; j < oversized.size() && oversized[j].aabb.minX <= a.aabb.maxX; ++j)
+            test(a, oversized[j]);
+
+        auto first = std::lower_bound(gridProxies.begin(), gridProxies.end(), a.aabb.minX, minXBelow);
+        for (auto it = first; it != gridProxies.end() && it->aabb.minX <= a.aabb.maxX; ++it)
+            test(a, *it);
+    }
+
+    for (const CellEntry &b : gridProxies)
+    {
+        auto first = std::upper_bound(oversized.begin(), oversized.end(), b.aabb.minX, minXAbove);
+        for (auto it = first; it != oversized.end() && it->aabb.minX <= b.aabb.maxX; ++it)
+            test(*it, b);
+    }
+}
+
+void sas::HierarchicalGrid::Clear() noexcept
+{
+    entries.clear();
+    unsorted.clear();
+    entryBuckets.clear();
+    oversized.clear();
+    gridProxies.clear();
+    bucketStart.clear();
+    levelOrder.clear();
+    proxies.clear();
+    proxySlots.clear();
+    bucketMask = 0;
+
+    for (Level &level : levels)
+    {
+        level.count = 0;
+        level.collisionMask = 0;
+    }
+}
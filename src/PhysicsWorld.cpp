@@ -5,8 +5,20 @@
 #include <utility>
 #include <algorithm>
 
-sas::PhysicsWorld::PhysicsWorld(Rectangle dims) noexcept
-    : boundaries(dims)
+sas::AABB sas::UniformMarginPolicy(const Body &body, const AABB &tight, float dt) noexcept
+{
+    const float predictiveMargin = std::max(2.0f, body.kinematics.velocity.length() * dt * 3.0f);
+
+    return ComputeSweptAABB(tight, {0, 0}, predictiveMargin);
+}
+
+sas::AABB sas::SweptMarginPolicy(const Body &body, const AABB &tight, float dt) noexcept
+{
+    return ComputeSweptAABB(tight, body.kinematics.velocity * (dt * 3.0f), 2.0f);
+}
+
+sas::PhysicsWorld::PhysicsWorld(Rectangle dims, QueryBackend backend) noexcept
+    : boundaries(dims), queryBackend(backend)
 {
 }
 
@@ -22,7 +34,8 @@ sas::BodyHandle sas::PhysicsWorld::CreateBody(Shape shape, const Transform &tran
 
 // Default
 // Flags::Active | Flags::RigidBody
-sas::BodyHandle sas::PhysicsWorld::CreateBodyFull(Shape shape, const Transform &trans, const Kinematics &kin, uint32_t options) noexcept
+sas::BodyHandle sas::PhysicsWorld::CreateBodyFull(Shape shape, const Transform &trans, const Kinematics &kin, uint32_t options,
+                                                  std::vector<TreeProxy> *deferredProxies) noexcept
 {
     uint32_t newID = GetNextId();
     uint32_t internalIndex = static_cast<uint32_t>(bodies.size());
@@ -44,8 +57,32 @@ sas::BodyHandle sas::PhysicsWorld::CreateBodyFull(Shape shape, const Transform &
     {
         newBody.collisionMask = Flags::Layer1 | Flags::Mask1;
 
-        activeIDs.push_back(newID);
-        AddToCollisionPool(newBody);
+        // Static bodies are never stepped
+        if (options & Flags::Static)
+        {
+            newBody.kinematics.velocity = {0, 0};
+            newBody.kinematics.inverseMass = 0;
+
+            AddToCollisionPool(newBody);
+        }
+        else if (deferredProxies)
+        {
+            newBody.flags |= Flags::InCollisionPool;
+            deferredProxies->emplace_back(newID, ComputeFatAABB(newBody));
+            dynamicTree.SetCollisionMask(newID, newBody.collisionMask);
+
+            if (!UsesDynamicTree())
+                AddProxy(newBody, deferredProxies->back().second);
+        }
+        else
+        {
+            AddToCollisionPool(newBody);
+        }
+
+        if (!(options & Flags::Static))
+        {
+            activeIDs.push_back(newID);
+        }
     }
 
     if (shape.type == ShapeType::Box)
@@ -60,6 +97,43 @@ sas::BodyHandle sas::PhysicsWorld::CreateBodyFull(Shape shape, const Transform &
     return {newID, this};
 }
 
+std::vector<sas::BodyHandle> sas::PhysicsWorld::CreateBodies(std::span<const BodyDef> defs) noexcept
+{
+    std::vector<BodyHandle> handles;
+    handles.reserve(defs.size());
+
+    std::vector<TreeProxy> proxies;
+    dynamicTree.GetProxies(proxies);
+
+    size_t existing = proxies.size();
+
+    bodies.reserve(bodies.size() + defs.size());
+    dense.reserve(dense.size() + defs.size());
+
+    for (const BodyDef &def : defs)
+    {
+        handles.push_back(CreateBodyFull(def.shape, def.transform, def.kinematics, def.options, &proxies));
+    }
+
+    if (proxies.size() != existing)
+    {
+        dynamicTree.Build(proxies);
+    }
+
+    return handles;
+}
+
+void sas::PhysicsWorld::RebuildBroadphase(uint32_t threadCount) noexcept
+{
+    SyncDynamicTree();
+
+    std::vector<TreeProxy> proxies;
+    dynamicTree.GetProxies(proxies);
+
+    // Same fat boxes, so the pairs stay valid
+    dynamicTree.BuildParallel(proxies, threadCount, false);
+}
+
 void sas::PhysicsWorld::RemoveBody(uint32_t bodyID) noexcept
 {
     if (bodies.empty())
@@ -69,6 +143,8 @@ void sas::PhysicsWorld::RemoveBody(uint32_t bodyID) noexcept
 
     uint32_t lastID = dense[lastIndex];
 
+    RemoveFromCollisionPool(bodies[indToRemove]);
+
     if (indToRemove != lastIndex)
     {
         bodies[indToRemove].flags = 0;
@@ -76,8 +152,6 @@ void sas::PhysicsWorld::RemoveBody(uint32_t bodyID) noexcept
 
         sparse[lastID] = indToRemove;
         dense[indToRemove] = lastID;
-
-        root.UpdateObject(bodies[indToRemove], 0.f);
     }
 
     auto it = std::find(activeIDs.begin(), activeIDs.end(), bodyID);
@@ -94,7 +168,6 @@ void sas::PhysicsWorld::RemoveBody(uint32_t bodyID) noexcept
     sparse[bodyID] = -1;
 
     freeIDs.push_back(bodyID);
-    root.remove(bodyID);
 }
 
 uint32_t sas::PhysicsWorld::GetNextId() noexcept
@@ -112,6 +185,17 @@ uint32_t sas::PhysicsWorld::GetNextId() noexcept
 void sas::PhysicsWorld::Step(float dt) noexcept
 {
     contacts.clear();
+
+    if (settings.broadphase != activeBroadphase)
+        SwitchBroadphase();
+
+    dynamicTree.SetUpdateMode(settings.treeUpdateMode, settings.refitGrowthLimit);
+    dynamicTree.ResetUpdateStats();
+
+    FlushStaticTree();
+
+    const bool treeBroadphase = UsesDynamicTree();
+
     for (uint32_t id : activeIDs)
     {
         Body &obj = bodies[sparse[id]];
@@ -126,66 +210,385 @@ void sas::PhysicsWorld::Step(float dt) noexcept
             Reset(obj);
         }
 
-        const float velocityLength = obj.kinematics.velocity.length();
+        if (obj.flags & Flags::InCollisionPool)
+        {
+            AABB tight = ComputeTightAABB(obj);
 
-        const float predictiveMargin = std::max(2.0f, velocityLength * dt * 3.0f);
+            if (treeBroadphase)
+                dynamicTree.UpdateObject(id, tight, settings.fatAABBPolicy(obj, tight, dt));
+            else
+                UpdateProxy(obj, tight, dt);
+        }
+    }
 
-        if (obj.flags & Flags::InCollisionPool)
+    if (treeBroadphase)
+        dynamicTree.Optimize(settings.treeOptimizeBudget);
+
+    UpdatePairs();
+
+    for (const BroadPair &pair : pairs)
+    {
+        CheckCollisionDispatcher(pair);
+    }
+
+    UpdateCollisionFlags();
+}
+void sas::PhysicsWorld::UpdatePairs() noexcept
+{
+    const BroadphaseType broadphase = activeBroadphase;
+    const bool treeBroadphase = UsesDynamicTree();
+
+    // Inserts and the catch ups of scene queries, nothing pairs from them
+    if (!treeBroadphase)
+        dynamicTree.ClearMoveBuffer();
+
+    const std::vector<uint32_t> &moved = treeBroadphase ? dynamicTree.GetMoveBuffer() : movedProxies;
+
+    if (moved.empty())
+        return;
+
+    if (moveFlags.size() < sparse.size())
+    {
+        moveFlags.resize(sparse.size(), 0);
+    }
+
+    for (uint32_t id : moved)
+    {
+        moveFlags[id] = 1;
+    }
+
+    // The tree re-pairs the bodies that moved, the grids find every dynamic pair again
+    // and sweep and prune says which dynamic pairs ended
+    const bool incremental = broadphase == BroadphaseType::Tree;
+
+    if (broadphase == BroadphaseType::SweepAndPrune)
+        sweepAndPrune.Update();
+
+    const std::vector<BroadPair> &ended = sweepAndPrune.GetRemovedPairs();
+
+    std::erase_if(pairs, [this, broadphase, incremental, &ended](const BroadPair &pair)
+                  {
+                      if (!incremental && !IsStatic(pair.bodyA) && !IsStatic(pair.bodyB))
+                          return broadphase != BroadphaseType::SweepAndPrune || std::binary_search(ended.begin(), ended.end(), pair);
+
+                      // Pairs where neither body moved still overlap
+                      if (!moveFlags[pair.bodyA] && !moveFlags[pair.bodyB])
+                          return false;
+
+                      return !AABBOverlap(GetProxyAABB(pair.bodyA), GetProxyAABB(pair.bodyB)); });
+
+    if (incremental && queryBackend != QueryBackend::Binary)
+    {
+        UpdateSnapshot(moved);
+    }
+
+    newPairs.clear();
+    for (uint32_t id : moved)
+    {
+        // Duplicate, or the body left the tree since it moved
+        if (moveFlags[id] != 1 || !HasDynamicProxy(id))
+            continue;
+
+        const AABB &fat = GetProxyAABB(id);
+        uint32_t collisionMask = bodies[sparse[id]].collisionMask;
+
+        // Subtrees of layers this body can not collide with are skipped
+        if (incremental)
         {
-            root.UpdateObject(obj, predictiveMargin);
+            QueryBroadphase(fat, collisionMask, [this, id](uint32_t otherID)
+                            {
+                                // A pair of two moved bodies is found by the first of them
+                                if (otherID == id || moveFlags[otherID] == 2)
+                                    return;
+
+                                newPairs.push_back({std::min(id, otherID), std::max(id, otherID)}); });
         }
+
+        staticTree.QueryVisit(fat, collisionMask, [this, id](uint32_t staticID)
+                              { newPairs.push_back({std::min(id, staticID), std::max(id, staticID)}); });
+
+        moveFlags[id] = 2;
     }
 
-    for (uint32_t id : activeIDs)
+    for (uint32_t id : moved)
     {
-        Body &obj = bodies[sparse[id]];
+        moveFlags[id] = 0;
+    }
+    dynamicTree.ClearMoveBuffer();
+    movedProxies.clear();
 
-        CheckCollisionDispatcher(obj);
+    if (broadphase == BroadphaseType::Grid)
+    {
+        hashGrid.Build(settings.gridCellSize);
+        hashGrid.FindAllPairs(newPairs);
+    }
+    else if (broadphase == BroadphaseType::HierarchicalGrid)
+    {
+        hierarchicalGrid.Build(settings.hierarchicalGridMinCellSize);
+        hierarchicalGrid.FindAllPairs(newPairs);
+    }
+    else if (broadphase == BroadphaseType::SweepAndPrune)
+    {
+        const std::vector<BroadPair> &started = sweepAndPrune.GetAddedPairs();
+        newPairs.insert(newPairs.end(), started.begin(), started.end());
     }
 
-    UpdateCollisionFlags();
+    MergeNewPairs();
 }
-// TODO:This sounds interesting
-// matrix[shapeA.type][shapeB.type](shapeA, shapeB)
 
-void sas::PhysicsWorld::CheckCollisionDispatcher(Body &obj) noexcept
+// Refitting keeps the collapsed structure, it gets looser as bodies wander off from where it was built
+// After as many refitted boxes as it has bodies the collapse has paid for itself and is done again
+// The quantized snapshot can't be refitted, it holds until a moved body leaves its padded box
+// A body the snapshot does not have, or a snapshot left out of date, needs a build
+// that a Step with few moved bodies would not win back, those query the binary tree instead
+void sas::PhysicsWorld::UpdateSnapshot(const std::vector<uint32_t> &moved) noexcept
 {
-    // Forcing static objects to to have 0 vel
-    // And 0 inverse mass otherwise
-    if (obj.flags & Flags::Static)
+    const bool wide = queryBackend == QueryBackend::Wide4;
+
+    if (snapshotValid && (wide ? wideTree.Refit(dynamicTree, moved) : quantizedTree.Covers(dynamicTree, moved)))
+    {
+        snapshotRefits += moved.size();
+
+        if (!wide || snapshotRefits <= wideTree.GetLeafCount())
+            return;
+    }
+    else if (moved.size() * SnapshotRebuildRatio < bodies.size())
+    {
+        snapshotValid = false;
+        return;
+    }
+
+    if (wide)
+        wideTree.Build(dynamicTree);
+    else
+        quantizedTree.Build(dynamicTree, settings.quantizedPadding);
+
+    snapshotValid = true;
+    snapshotRefits = 0;
+}
+
+void sas::PhysicsWorld::FlushStaticTree() noexcept
+{
+    if (pendingStatics.empty())
+        return;
+
+    std::vector<TreeProxy> proxies;
+    staticTree.GetProxies(proxies);
+
+    size_t existing = proxies.size();
+
+    // The dynamic bodies around the new statics are found in the dynamic tree
+    SyncDynamicTree();
+
+    for (uint32_t id : pendingStatics)
     {
-        obj.kinematics.velocity = {0, 0};
-        obj.kinematics.inverseMass = 0;
+        proxies.emplace_back(id, ComputeTightAABB(bodies[sparse[id]]));
+    }
+    pendingStatics.clear();
+
+    staticTree.Build(proxies, false);
+    staticTree.ClearMoveBuffer();
+
+    // New statics pair with the dynamic bodies already around them
+    newPairs.clear();
+    for (size_t i = existing; i < proxies.size(); ++i)
+    {
+        uint32_t staticID = proxies[i].first;
+
+        dynamicTree.QueryVisit(proxies[i].second, bodies[sparse[staticID]].collisionMask, [this, staticID](uint32_t otherID)
+                               { newPairs.push_back({std::min(staticID, otherID), std::max(staticID, otherID)}); });
+    }
+
+    MergeNewPairs();
+}
+
+void sas::PhysicsWorld::MergeNewPairs() noexcept
+{
+    if (newPairs.empty())
         return;
+
+    std::sort(newPairs.begin(), newPairs.end());
+
+    size_t oldCount = pairs.size();
+    pairs.insert(pairs.end(), newPairs.begin(), newPairs.end());
+    std::inplace_merge(pairs.begin(), pairs.begin() + oldCount, pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    newPairs.clear();
+}
+
+bool sas::PhysicsWorld::IsStatic(uint32_t bodyID) const noexcept
+{
+    return bodies[sparse[bodyID]].flags & Flags::Static;
+}
+
+const sas::AABB &sas::PhysicsWorld::GetProxyAABB(uint32_t bodyID) const noexcept
+{
+    if (IsStatic(bodyID))
+        return staticTree.GetFatAABB(bodyID);
+
+    return UsesDynamicTree() ? dynamicTree.GetFatAABB(bodyID) : proxyBoxes[bodyID];
+}
+
+bool sas::PhysicsWorld::UsesDynamicTree() const noexcept
+{
+    return activeBroadphase == BroadphaseType::Tree;
+}
+
+bool sas::PhysicsWorld::HasDynamicProxy(uint32_t bodyID) const noexcept
+{
+    if (UsesDynamicTree())
+        return dynamicTree.Contains(bodyID);
+
+    return sparse[bodyID] >= 0 && (bodies[sparse[bodyID]].flags & (Flags::InCollisionPool | Flags::Static)) == Flags::InCollisionPool;
+}
+
+void sas::PhysicsWorld::AddProxy(const Body &body, const AABB &fat) noexcept
+{
+    if (body.bodyID >= proxyBoxes.size())
+    {
+        proxyBoxes.resize(body.bodyID + 1);
     }
 
-    std::vector<uint32_t> potentialCollisions;
+    proxyBoxes[body.bodyID] = fat;
+    movedProxies.push_back(body.bodyID);
+    dynamicTreeStale = true;
 
-    root.Query(ComputeTightAABB(obj), potentialCollisions);
+    if (activeBroadphase == BroadphaseType::Grid)
+        hashGrid.SetProxy(body.bodyID, fat, body.collisionMask);
+    else if (activeBroadphase == BroadphaseType::SweepAndPrune)
+        sweepAndPrune.SetProxy(body.bodyID, fat, body.collisionMask);
+    else if (activeBroadphase == BroadphaseType::HierarchicalGrid)
+        hierarchicalGrid.SetProxy(body.bodyID, fat, body.collisionMask);
+}
 
-    for (uint32_t otherID : potentialCollisions)
+// Same rule as AABBTree::UpdateObject, the fat box stays while the tight one is inside it
+void sas::PhysicsWorld::UpdateProxy(const Body &body, const AABB &tight, float dt) noexcept
+{
+    AABB &fat = proxyBoxes[body.bodyID];
+
+    if (AABBContains(fat, tight))
+        return;
+
+    // Bodies pushed apart later in the Step can leave their tight box, the fat one still has their pairs
+    AddProxy(body, settings.fatAABBPolicy(body, tight, dt));
+}
+
+void sas::PhysicsWorld::SyncDynamicTree() noexcept
+{
+    if (!dynamicTreeStale)
+        return;
+
+    dynamicTreeStale = false;
+
+    for (const Body &body : bodies)
     {
-        auto &other = bodies[sparse[otherID]];
+        if ((body.flags & (Flags::InCollisionPool | Flags::Static)) == Flags::InCollisionPool)
+            dynamicTree.UpdateObject(body.bodyID, proxyBoxes[body.bodyID], proxyBoxes[body.bodyID]);
+    }
+}
 
-        bool otherIsStatic = (other.flags & Flags::Static);
+void sas::PhysicsWorld::SwitchBroadphase() noexcept
+{
+    const bool fromTree = UsesDynamicTree();
 
-        if (!otherIsStatic && obj.bodyID >= otherID)
-            continue;
+    // Their boxes go stale while another broadphase runs
+    hashGrid.Clear();
+    sweepAndPrune.Clear();
+    hierarchicalGrid.Clear();
+    activeBroadphase = settings.broadphase;
 
-        uint32_t objLayer = obj.collisionMask & 0x0000FFFF;
-        uint32_t objMask = (obj.collisionMask & 0xFFFF0000) >> 16;
+    if (UsesDynamicTree())
+    {
+        if (fromTree)
+            return;
+
+        // Leaves of the tree can be bigger than the boxes the pairs were found with
+        SyncDynamicTree();
+        dynamicTree.ClearMoveBuffer();
+        movedProxies.clear();
+        snapshotValid = false;
+
+        pairs.clear();
+        newPairs.clear();
+        dynamicTree.FindAllPairs(newPairs);
+
+        std::vector<TreeProxy> proxies;
+        dynamicTree.GetProxies(proxies);
+
+        for (const auto &[id, fat] : proxies)
+        {
+            staticTree.QueryVisit(fat, bodies[sparse[id]].collisionMask, [this, id](uint32_t staticID)
+                                  { newPairs.push_back({std::min(id, staticID), std::max(id, staticID)}); });
+        }
 
-        uint32_t otherLayer = other.collisionMask & 0x0000FFFF;
-        uint32_t otherMask = (other.collisionMask & 0xFFFF0000) >> 16;
+        MergeNewPairs();
+        return;
+    }
 
-        if (!(objMask & otherLayer) || !(otherMask & objLayer))
+    // The new broadphase starts from the fat boxes the pairs were found with
+    for (const Body &body : bodies)
+    {
+        if ((body.flags & (Flags::InCollisionPool | Flags::Static)) != Flags::InCollisionPool)
             continue;
 
-        // This will crash if obj.shape.type is greater than the types
-        // So if the user somehow updates the shape type with some random value
-        // GG
-        (this->*DispatchTable[static_cast<int>(obj.shape.type)][static_cast<int>(other.shape.type)])(obj, other);
+        if (fromTree)
+        {
+            if (body.bodyID >= proxyBoxes.size())
+                proxyBoxes.resize(body.bodyID + 1);
+
+            proxyBoxes[body.bodyID] = dynamicTree.GetFatAABB(body.bodyID);
+        }
+
+        AddProxy(body, proxyBoxes[body.bodyID]);
+    }
+}
+
+void sas::PhysicsWorld::DestroyPairs(uint32_t bodyID) noexcept
+{
+    std::erase_if(pairs, [bodyID](const BroadPair &pair)
+                  { return pair.bodyA == bodyID || pair.bodyB == bodyID; });
+}
+
+// TODO:This sounds interesting
+// matrix[shapeA.type][shapeB.type](shapeA, shapeB)
+
+void sas::PhysicsWorld::CheckCollisionDispatcher(const BroadPair &pair) noexcept
+{
+    Body &first = bodies[sparse[pair.bodyA]];
+    Body &second = bodies[sparse[pair.bodyB]];
+
+    bool firstIsStatic = (first.flags & Flags::Static);
+    bool secondIsStatic = (second.flags & Flags::Static);
+
+    if (firstIsStatic && secondIsStatic)
+        return;
+
+    // Static bodies are always resolved as the other body
+    Body &obj = firstIsStatic ? second : first;
+    Body &other = firstIsStatic ? first : second;
+
+    // Forcing static objects to to have 0 vel
+    // And 0 inverse mass otherwise
+    if (firstIsStatic || secondIsStatic)
+    {
+        other.kinematics.velocity = {0, 0};
+        other.kinematics.inverseMass = 0;
     }
+
+    uint32_t objLayer = obj.collisionMask & 0x0000FFFF;
+    uint32_t objMask = (obj.collisionMask & 0xFFFF0000) >> 16;
+
+    uint32_t otherLayer = other.collisionMask & 0x0000FFFF;
+    uint32_t otherMask = (other.collisionMask & 0xFFFF0000) >> 16;
+
+    if (!(objMask & otherLayer) || !(otherMask & objLayer))
+        return;
+
+    // This will crash if obj.shape.type is greater than the types
+    // So if the user somehow updates the shape type with some random value
+    // GG
+    (this->*DispatchTable[static_cast<int>(obj.shape.type)][static_cast<int>(other.shape.type)])(obj, other);
 }
 
 void sas::PhysicsWorld::CheckCollisionCircleCircle(Body &obj, Body &other) noexcept
@@ -552,8 +955,57 @@ void sas::PhysicsWorld::AddToCollisionPool(Body &body) noexcept
     {
         body.flags |= Flags::InCollisionPool;
 
-        root.insert(body.bodyID, ComputeFatAABB(body));
+        // Batched into one rebuild of the static tree at the next Step
+        if (body.flags & Flags::Static)
+        {
+            staticTree.SetCollisionMask(body.bodyID, body.collisionMask);
+            pendingStatics.push_back(body.bodyID);
+        }
+        else
+        {
+            AABB fat = ComputeFatAABB(body);
+
+            dynamicTree.SetCollisionMask(body.bodyID, body.collisionMask);
+            dynamicTree.insert(body.bodyID, fat);
+
+            if (!UsesDynamicTree())
+                AddProxy(body, fat);
+        }
+    }
+}
+
+void sas::PhysicsWorld::SetCollisionMask(uint32_t bodyID, uint32_t collisionMask) noexcept
+{
+    Body &body = bodies[sparse[bodyID]];
+    body.collisionMask = collisionMask;
+
+    if (!(body.flags & Flags::InCollisionPool))
+        return;
+
+    if (!(body.flags & Flags::Static))
+    {
+        // Lands in the move buffer, so the next Step re-pairs it
+        dynamicTree.SetCollisionMask(bodyID, collisionMask);
+
+        if (!UsesDynamicTree())
+            AddProxy(body, proxyBoxes[bodyID]);
+        return;
     }
+
+    staticTree.SetCollisionMask(bodyID, collisionMask);
+
+    // Pending statics are paired when the static tree is flushed
+    if (!staticTree.Contains(bodyID))
+        return;
+
+    staticTree.ClearMoveBuffer();
+    SyncDynamicTree();
+
+    newPairs.clear();
+    dynamicTree.QueryVisit(staticTree.GetFatAABB(bodyID), collisionMask, [this, bodyID](uint32_t otherID)
+                           { newPairs.push_back({std::min(bodyID, otherID), std::max(bodyID, otherID)}); });
+
+    MergeNewPairs();
 }
 
 void sas::PhysicsWorld::RemoveFromCollisionPool(Body &body) noexcept
@@ -562,7 +1014,20 @@ void sas::PhysicsWorld::RemoveFromCollisionPool(Body &body) noexcept
     {
         body.flags &= ~Flags::InCollisionPool;
 
-        root.remove(body.bodyID);
+        if (body.flags & Flags::Static)
+        {
+            std::erase(pendingStatics, body.bodyID);
+            staticTree.remove(body.bodyID);
+        }
+        else
+        {
+            dynamicTree.remove(body.bodyID);
+            // The id can be reused before the next Step
+            sweepAndPrune.Remove(body.bodyID);
+            hashGrid.RemoveProxy(body.bodyID);
+            hierarchicalGrid.RemoveProxy(body.bodyID);
+        }
+        DestroyPairs(body.bodyID);
     }
 }
 
@@ -611,6 +1076,485 @@ std::vector<sas::CollisionInfo> sas::PhysicsWorld::GetAllCollisions(uint32_t id)
     return collisions;
 }
 
+sas::BroadphaseStats sas::PhysicsWorld::GetBroadphaseStats() const noexcept
+{
+    const UpdateStats &updates = dynamicTree.GetUpdateStats();
+
+    return {updates.refits, updates.reinserts, updates.optimized, dynamicTree.GetHeight(), dynamicTree.GetSAHCost()};
+}
+
+// Fraction and normal of the first point where the segment enters the circle
+static bool RayCastCircle(const sas::RayCastInput &input, const sas::Body &circle, float &fraction, sas::math::Vec2 &normal) noexcept
+{
+    float r = circle.shape.radius * std::max(circle.transform.scale.x, circle.transform.scale.y);
+
+    sas::math::Vec2 m = input.origin - circle.transform.position;
+    const sas::math::Vec2 &d = input.translation;
+
+    float c = sas::math::dotProduct(m, m) - r * r;
+
+    // Starts inside
+    if (c <= 0.f)
+        return false;
+
+    float a = sas::math::dotProduct(d, d);
+    float b = sas::math::dotProduct(m, d);
+
+    if (a < 1e-12f || b >= 0.f)
+        return false;
+
+    float disc = b * b - a * c;
+    if (disc < 0.f)
+        return false;
+
+    float t = (-b - std::sqrt(disc)) / a;
+    if (t < 0.f || t > input.maxFraction)
+        return false;
+
+    fraction = t;
+    normal = (m + d * t) / r;
+
+    return true;
+}
+
+// Slab test in the box's local frame
+static bool RayCastBox(const sas::RayCastInput &input, const sas::Body &box, float &fraction, sas::math::Vec2 &normal) noexcept
+{
+    float hx = box.shape.halfSize.x * box.transform.scale.x;
+    float hy = box.shape.halfSize.y * box.transform.scale.y;
+    float cosA = std::cos(box.transform.rotation);
+    float sinA = std::sin(box.transform.rotation);
+
+    sas::math::Vec2 m = input.origin - box.transform.position;
+    const sas::math::Vec2 &d = input.translation;
+
+    const float origin[2] = {m.x * cosA + m.y * sinA, -m.x * sinA + m.y * cosA};
+    const float dir[2] = {d.x * cosA + d.y * sinA, -d.x * sinA + d.y * cosA};
+    const float half[2] = {hx, hy};
+
+    float tEnter = -std::numeric_limits<float>::max();
+    float tExit = std::numeric_limits<float>::max();
+    int enterAxis = -1;
+
+    for (int axis = 0; axis < 2; ++axis)
+    {
+        if (std::abs(dir[axis]) < 1e-12f)
+        {
+            if (std::abs(origin[axis]) > half[axis])
+                return false;
+
+            continue;
+        }
+
+        float inv = 1.f / dir[axis];
+        float t1 = (-half[axis] - origin[axis]) * inv;
+        float t2 = (half[axis] - origin[axis]) * inv;
+
+        if (t1 > t2)
+            std::swap(t1, t2);
+
+        if (t1 > tEnter)
+        {
+            tEnter = t1;
+            enterAxis = axis;
+        }
+
+        tExit = std::min(tExit, t2);
+
+        if (tEnter > tExit)
+            return false;
+    }
+
+    // Starts inside or misses the segment
+    if (enterAxis < 0 || tEnter <= 0.f || tEnter > input.maxFraction)
+        return false;
+
+    float localNormal[2] = {0.f, 0.f};
+    localNormal[enterAxis] = dir[enterAxis] > 0.f ? -1.f : 1.f;
+
+    fraction = tEnter;
+    normal = {localNormal[0] * cosA - localNormal[1] * sinA,
+              localNormal[0] * sinA + localNormal[1] * cosA};
+
+    return true;
+}
+
+// Exact test of one tree candidate, returns the new max fraction of the ray
+static float RayCastBody(const sas::RayCastInput &input, const sas::Body &body, uint32_t layerMask, sas::RayHit &result) noexcept
+{
+    if (!(body.collisionMask & layerMask & sas::Flags::LayerAll))
+        return input.maxFraction;
+
+    float fraction;
+    sas::math::Vec2 normal;
+
+    bool hit = body.shape.type == sas::ShapeType::Circle
+                   ? RayCastCircle(input, body, fraction, normal)
+                   : RayCastBox(input, body, fraction, normal);
+
+    if (!hit)
+        return input.maxFraction;
+
+    result.hit = true;
+    result.bodyID = body.bodyID;
+    result.fraction = fraction;
+    result.normal = normal;
+
+    return fraction;
+}
+
+sas::RayHit sas::PhysicsWorld::RayCast(const Ray &ray, uint32_t layerMask) noexcept
+{
+    FlushStaticTree();
+    SyncDynamicTree();
+
+    RayHit result;
+    RayCastInput input{ray.origin, ray.translation, 1.f};
+
+    auto callback = [this, &result, layerMask](const RayCastInput &clipped, uint32_t bodyID)
+    {
+        return RayCastBody(clipped, bodies[sparse[bodyID]], layerMask, result);
+    };
+
+    // The second tree starts from what the first one already clipped
+    staticTree.RayCast(input, callback);
+    input.maxFraction = result.fraction;
+    dynamicTree.RayCast(input, callback);
+
+    if (result.hit)
+        result.point = ray.origin + ray.translation * result.fraction;
+
+    return result;
+}
+
+void sas::PhysicsWorld::RayCastBatch(std::span<const Ray> rays, std::span<RayHit> hits, uint32_t layerMask) noexcept
+{
+    FlushStaticTree();
+    SyncDynamicTree();
+
+    // Rays without a hit slot are skipped rather than written past the end of hits
+    size_t rayCount = std::min(rays.size(), hits.size());
+
+    for (size_t first = 0; first < rayCount; first += 4)
+    {
+        const Ray *packetRays = rays.data() + first;
+        RayHit *packetHits = hits.data() + first;
+        int count = static_cast<int>(std::min<size_t>(4, rayCount - first));
+
+        RayPacket packet;
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if (lane < count)
+            {
+                packetHits[lane] = {};
+                packet.SetLane(lane, packetRays[lane].origin, packetRays[lane].translation, 1.f);
+            }
+            else
+            {
+                packet.ClearLane(lane);
+            }
+        }
+
+        auto callback = [this, &packet, packetRays, packetHits, layerMask](int lane, uint32_t bodyID)
+        {
+            RayCastInput input{packetRays[lane].origin, packetRays[lane].translation, packet.maxFraction[lane]};
+
+            return RayCastBody(input, bodies[sparse[bodyID]], layerMask, packetHits[lane]);
+        };
+
+        staticTree.RayCastPacket(packet, callback);
+        dynamicTree.RayCastPacket(packet, callback);
+
+        for (int lane = 0; lane < count; ++lane)
+        {
+            RayHit &hit = packetHits[lane];
+            if (hit.hit)
+                hit.point = packetRays[lane].origin + packetRays[lane].translation * hit.fraction;
+        }
+    }
+}
+
+struct ShapeDistance
+{
+    // <= 0 when the shapes overlap, the other fields are unset then
+    float distance;
+    // From the first shape towards the second
+    sas::math::Vec2 normal;
+    // Closest point on the second shape
+    sas::math::Vec2 point;
+};
+
+static float ScaledRadius(const sas::Body &circle) noexcept
+{
+    return circle.shape.radius * std::max(circle.transform.scale.x, circle.transform.scale.y);
+}
+
+// Closest point of the solid box to p, equals p when p is inside
+static sas::math::Vec2 ClosestPointOnBox(const sas::math::Vec2 &p, const sas::Body &box) noexcept
+{
+    float hx = box.shape.halfSize.x * box.transform.scale.x;
+    float hy = box.shape.halfSize.y * box.transform.scale.y;
+    float cosA = std::cos(box.transform.rotation);
+    float sinA = std::sin(box.transform.rotation);
+
+    sas::math::Vec2 d = p - box.transform.position;
+
+    float lx = std::clamp(d.x * cosA + d.y * sinA, -hx, hx);
+    float ly = std::clamp(-d.x * sinA + d.y * cosA, -hy, hy);
+
+    return box.transform.position + sas::math::Vec2{lx * cosA - ly * sinA, lx * sinA + ly * cosA};
+}
+
+static bool BoxesOverlap(const sas::Body &a, const sas::Body &b) noexcept
+{
+    BoxCorners cornersA = GetBoxCorners(a);
+    BoxCorners cornersB = GetBoxCorners(b);
+
+    const sas::math::Vec2 axes[4] = {
+        {std::cos(a.transform.rotation), std::sin(a.transform.rotation)},
+        {-std::sin(a.transform.rotation), std::cos(a.transform.rotation)},
+        {std::cos(b.transform.rotation), std::sin(b.transform.rotation)},
+        {-std::sin(b.transform.rotation), std::cos(b.transform.rotation)}};
+
+    for (const auto &axis : axes)
+    {
+        float minA = std::numeric_limits<float>::max(), maxA = -minA;
+        float minB = minA, maxB = -minA;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            float pa = sas::math::dotProduct(cornersA.v[i], axis);
+            float pb = sas::math::dotProduct(cornersB.v[i], axis);
+
+            minA = std::min(minA, pa);
+            maxA = std::max(maxA, pa);
+            minB = std::min(minB, pb);
+            maxB = std::max(maxB, pb);
+        }
+
+        if (maxA < minB || maxB < minA)
+            return false;
+    }
+
+    return true;
+}
+
+// Separation of two shapes, for boxes the closest features are always a corner and an edge
+static ShapeDistance GetShapeDistance(const sas::Body &a, const sas::Body &b) noexcept
+{
+    using sas::ShapeType;
+
+    if (a.shape.type == ShapeType::Circle && b.shape.type == ShapeType::Circle)
+    {
+        sas::math::Vec2 d = b.transform.position - a.transform.position;
+        float len = d.length();
+        float rb = ScaledRadius(b);
+
+        ShapeDistance result{len - ScaledRadius(a) - rb, {1.f, 0.f}, {}};
+        if (len > 1e-6f)
+            result.normal = d / len;
+        result.point = b.transform.position - result.normal * rb;
+
+        return result;
+    }
+
+    if (a.shape.type == ShapeType::Circle || b.shape.type == ShapeType::Circle)
+    {
+        bool circleFirst = a.shape.type == ShapeType::Circle;
+        const sas::Body &circle = circleFirst ? a : b;
+        const sas::Body &box = circleFirst ? b : a;
+
+        sas::math::Vec2 center = circle.transform.position;
+        sas::math::Vec2 closest = ClosestPointOnBox(center, box);
+        sas::math::Vec2 d = center - closest;
+        float len = d.length();
+        float r = ScaledRadius(circle);
+
+        if (len <= 1e-6f)
+            return {-r, {}, {}};
+
+        // Box towards circle
+        sas::math::Vec2 n = d / len;
+
+        if (circleFirst)
+            return {len - r, -1 * n, closest};
+
+        return {len - r, n, center - n * r};
+    }
+
+    if (BoxesOverlap(a, b))
+        return {0.f, {}, {}};
+
+    ShapeDistance best{std::numeric_limits<float>::max(), {}, {}};
+
+    BoxCorners cornersA = GetBoxCorners(a);
+    BoxCorners cornersB = GetBoxCorners(b);
+
+    for (int i = 0; i < 4; ++i)
+    {
+        sas::math::Vec2 onB = ClosestPointOnBox(cornersA.v[i], b);
+        sas::math::Vec2 d = onB - cornersA.v[i];
+        float len = d.length();
+
+        if (len < best.distance)
+            best = {len, d / len, onB};
+
+        sas::math::Vec2 onA = ClosestPointOnBox(cornersB.v[i], a);
+        d = cornersB.v[i] - onA;
+        len = d.length();
+
+        if (len < best.distance)
+            best = {len, d / len, cornersB.v[i]};
+    }
+
+    return best;
+}
+
+sas::RayHit sas::PhysicsWorld::ShapeCast(Shape shape, const Transform &trans, math::Vec2 translation, uint32_t layerMask) noexcept
+{
+    // Stop advancing once this close, so the reported pose never overlaps
+    constexpr float Tolerance = 0.01f;
+    constexpr int MaxIterations = 32;
+
+    FlushStaticTree();
+    SyncDynamicTree();
+
+    Body caster{trans, {}, shape, 0, 0, 0};
+
+    AABB start = ComputeTightAABB(caster);
+    AABB swept = AABBUnion(start, {start.minX + translation.x, start.minY + translation.y,
+                                   start.maxX + translation.x, start.maxY + translation.y});
+
+    RayHit result;
+
+    // Conservative advancement, the distance is convex in t for a pure translation
+    // so stepping by distance / closing speed never skips past the contact
+    auto visitor = [&](uint32_t bodyID)
+    {
+        const Body &other = bodies[sparse[bodyID]];
+
+        if (!(other.collisionMask & layerMask & Flags::LayerAll))
+            return;
+
+        float t = 0.f;
+        caster.transform.position = trans.position;
+
+        auto record = [&](const ShapeDistance &sep)
+        {
+            if (result.hit && t >= result.fraction)
+                return;
+
+            result.hit = true;
+            result.bodyID = bodyID;
+            result.fraction = t;
+            result.normal = -1 * sep.normal;
+            result.point = sep.point;
+
+            // Already overlapping, there is no surface to report
+            if (sep.distance <= 0.f)
+                result.point = caster.transform.position;
+        };
+
+        for (int i = 0; i < MaxIterations; ++i)
+        {
+            ShapeDistance sep = GetShapeDistance(caster, other);
+
+            if (sep.distance <= Tolerance)
+            {
+                record(sep);
+                return;
+            }
+
+            float closing = math::dotProduct(translation, sep.normal);
+            if (closing <= 0.f)
+                return;
+
+            t += (sep.distance - 0.5f * Tolerance) / closing;
+
+            if (t > 1.f || (result.hit && t >= result.fraction))
+                return;
+
+            caster.transform.position = trans.position + translation * t;
+        }
+
+        // Out of iterations while still closing in, as on a grazing approach, report the pose reached
+        // so far, it never overlaps and sits before the true contact, rather than a false miss
+        record(GetShapeDistance(caster, other));
+    };
+
+    staticTree.QueryVisit(swept, visitor);
+    dynamicTree.QueryVisit(swept, visitor);
+
+    return result;
+}
+
+size_t sas::PhysicsWorld::QueryNearest(const math::Vec2 &point, std::span<NearestResult> results, float maxDist, uint32_t layerMask) noexcept
+{
+    FlushStaticTree();
+    SyncDynamicTree();
+
+    auto distance = [this, &point, layerMask](uint32_t bodyID)
+    {
+        const Body &body = bodies[sparse[bodyID]];
+
+        if (!(body.collisionMask & layerMask & Flags::LayerAll))
+            return -1.f;
+
+        if (body.shape.type == ShapeType::Circle)
+            return std::max((point - body.transform.position).length() - ScaledRadius(body), 0.f);
+
+        return (point - ClosestPointOnBox(point, body)).length();
+    };
+
+    size_t count = dynamicTree.QueryNearest(point, maxDist, results, distance);
+
+    return staticTree.QueryNearest(point, maxDist, results, distance, count);
+}
+
+static bool ShapeContainsPoint(const sas::Body &body, const sas::math::Vec2 &point) noexcept
+{
+    sas::math::Vec2 d = point - body.transform.position;
+
+    if (body.shape.type == sas::ShapeType::Circle)
+    {
+        float r = ScaledRadius(body);
+        return d.lengthSq() <= r * r;
+    }
+
+    float cosA = std::cos(body.transform.rotation);
+    float sinA = std::sin(body.transform.rotation);
+
+    return std::abs(d.x * cosA + d.y * sinA) <= body.shape.halfSize.x * body.transform.scale.x &&
+           std::abs(-d.x * sinA + d.y * cosA) <= body.shape.halfSize.y * body.transform.scale.y;
+}
+
+std::optional<uint32_t> sas::PhysicsWorld::QueryPoint(const math::Vec2 &point, uint32_t layerMask) noexcept
+{
+    FlushStaticTree();
+    SyncDynamicTree();
+
+    std::optional<uint32_t> result;
+    AABB box{point.x, point.y, point.x, point.y};
+
+    auto visitor = [this, &point, &result, layerMask](uint32_t bodyID)
+    {
+        const Body &body = bodies[sparse[bodyID]];
+
+        if (!(body.collisionMask & layerMask & Flags::LayerAll) || !ShapeContainsPoint(body, point))
+            return true;
+
+        result = bodyID;
+        return false;
+    };
+
+    dynamicTree.QueryVisit(box, visitor);
+
+    if (!result)
+        staticTree.QueryVisit(box, visitor);
+
+    return result;
+}
+
 void sas::PhysicsWorld::RemoveBody(const BodyHandle &handle) noexcept
 {
     RemoveBody(handle.get()->bodyID);
@@ -618,12 +1562,31 @@ void sas::PhysicsWorld::RemoveBody(const BodyHandle &handle) noexcept
 
 void sas::PhysicsWorld::DrawDebug(const DrawCallback &cb) const noexcept
 {
-    root.Draw(cb);
+    staticTree.Draw(cb);
+
+    if (UsesDynamicTree())
+    {
+        dynamicTree.Draw(cb);
+        return;
+    }
+
+    for (const Body &body : bodies)
+    {
+        if ((body.flags & (Flags::InCollisionPool | Flags::Static)) == Flags::InCollisionPool)
+            cb(proxyBoxes[body.bodyID], true);
+    }
 }
 
 void sas::PhysicsWorld::Clear() noexcept
 {
-    root.Clear();
+    dynamicTree.Clear();
+    staticTree.Clear();
+    pendingStatics.clear();
+    wideTree.Clear();
+    quantizedTree.Clear();
+    hashGrid.Clear();
+    sweepAndPrune.Clear();
+    hierarchicalGrid.Clear();
     bodies.clear();
     bodies.clear();
     sparse.clear();
@@ -632,6 +1595,13 @@ void sas::PhysicsWorld::Clear() noexcept
     freeIDs.clear();
     activeIDs.clear();
     contacts.clear();
+    pairs.clear();
+    moveFlags.clear();
+    proxyBoxes.clear();
+    movedProxies.clear();
+    dynamicTreeStale = false;
+    snapshotValid = false;
+    snapshotRefits = 0;
 
     idCounter = 0;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "QuantizedBVH.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void sas::QuantizedBVH::Build(const AABBTree &tree, float boxPadding) noexcept
+{
+    nodes.clear();
+    depth = 0;
+    padding = boxPadding;
+
+    const float highest = std::numeric_limits<float>::max();
+    const float lowest = std::numeric_limits<float>::lowest();
+    leafBounds.assign(tree.leafMap.size(), AABB{highest, highest, lowest, lowest});
+
+    if (tree.root == NullNode)
+        return;
+
+    // Padding every box by the same amount keeps each parent the union of its children
+    const Node &root = tree.nodes[tree.root];
+    rootBox = Pad(root.aabb);
+
+    if (!root.isLeaf())
+    {
+        nodes.reserve(tree.nodes.size() / 2 + 1);
+        BuildNode(tree, tree.root, rootBox, 1);
+        return;
+    }
+
+    // Single body, one node with a single child covering the whole root box
+    QuantizedNode node{};
+    Encode(node, 0, rootBox, rootBox);
+    node.children[0] = static_cast<uint32_t>(root.objectID) | QuantizedLeafBit;
+    node.children[1] = NullNode;
+    leafBounds[root.objectID] = rootBox;
+
+    nodes.push_back(node);
+    depth = 1;
+}
+
+void sas::QuantizedBVH::Encode(QuantizedNode &node, int child, const AABB &box, const AABB &parent) noexcept
+{
+    float extentX = parent.maxX - parent.minX;
+    float extentY = parent.maxY - parent.minY;
+
+    auto quantize = [](float offset, float extent, bool roundUp) -> uint16_t
+    {
+        if (extent <= 0.f)
+            return roundUp ? static_cast<uint16_t>(QuantizedMax) : 0;
+
+        float q = offset / extent * QuantizedMax;
+        q = roundUp ? std::ceil(q) : std::floor(q);
+
+        return static_cast<uint16_t>(std::clamp(q, 0.f, QuantizedMax));
+    };
+
+    node.minX[child] = quantize(box.minX - parent.minX, extentX, false);
+    node.minY[child] = quantize(box.minY - parent.minY, extentY, false);
+    node.maxX[child] = quantize(box.maxX - parent.minX, extentX, true);
+    node.maxY[child] = quantize(box.maxY - parent.minY, extentY, true);
+
+    // Float error can still put a decoded bound a hair inside the real one, widen until it is not
+    AABB decoded = Decode(node, child, parent);
+
+    while (decoded.minX > box.minX && node.minX[child] > 0)
+    {
+        --node.minX[child];
+        decoded = Decode(node, child, parent);
+    }
+    while (decoded.minY > box.minY && node.minY[child] > 0)
+    {
+        --node.minY[child];
+        decoded = Decode(node, child, parent);
+    }
+    while (decoded.maxX < box.maxX && node.maxX[child] < QuantizedMax)
+    {
+        ++node.maxX[child];
+        decoded = Decode(node, child, parent);
+    }
+    while (decoded.maxY < box.maxY && node.maxY[child] < QuantizedMax)
+    {
+        ++node.maxY[child];
+        decoded = Decode(node, child, parent);
+    }
+}
+
+// Children are encoded against the decoded box of their parent, which is what queries see
+uint32_t sas::QuantizedBVH::BuildNode(const AABBTree &tree, uint32_t binaryNode, const AABB &decoded, int level) noexcept
+{
+    depth = std::max(depth, level);
+
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    QuantizedNode node{};
+    const Node &binary = tree.nodes[binaryNode];
+
+    for (int i = 0; i < 2; ++i)
+    {
+        const Node &child = tree.nodes[binary.children[i]];
+        AABB padded = Pad(child.aabb);
+        Encode(node, i, padded, decoded);
+
+        if (child.isLeaf())
+        {
+            node.children[i] = static_cast<uint32_t>(child.objectID) | QuantizedLeafBit;
+            leafBounds[child.objectID] = padded;
+        }
+        else
+            node.children[i] = BuildNode(tree, binary.children[i], Decode(node, i, decoded), level + 1);
+    }
+
+    // The recursion may have grown the pool
+    nodes[index] = node;
+
+    return index;
+}
+
+bool sas::QuantizedBVH::Covers(const AABBTree &tree, std::span<const uint32_t> bodyIDs) const noexcept
+{
+    for (uint32_t id : bodyIDs)
+    {
+        // Removed since it moved
+        if (!tree.Contains(id))
+            continue;
+
+        if (id >= leafBounds.size() || !AABBContains(leafBounds[id], tree.GetFatAABB(id)))
+            return false;
+    }
+
+    return true;
+}
+
+void sas::QuantizedBVH::Clear() noexcept
+{
+    nodes.clear();
+    leafBounds.clear();
+    depth = 0;
+}
@@ -0,0 +1,190 @@
+#include "SpatialHashGrid.hpp"
+
+#include <algorithm>
+#include <bit>
+
+void sas::SpatialHashGrid::SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept
+{
+    if (bodyID >= proxySlots.size())
+    {
+        proxySlots.resize(bodyID + 1, NullNode);
+    }
+
+    if (proxySlots[bodyID] == NullNode)
+    {
+        proxySlots[bodyID] = static_cast<uint32_t>(proxies.size());
+        proxies.push_back({aabb, 0, 0, bodyID, collisionMask});
+        return;
+    }
+
+    CellEntry &proxy = proxies[proxySlots[bodyID]];
+    proxy.aabb = aabb;
+    proxy.collisionMask = collisionMask;
+}
+
+void sas::SpatialHashGrid::RemoveProxy(uint32_t bodyID) noexcept
+{
+    if (!Contains(bodyID))
+        return;
+
+    uint32_t slot = proxySlots[bodyID];
+    proxies[slot] = proxies.back();
+    proxySlots[proxies[slot].bodyID] = slot;
+
+    proxies.pop_back();
+    proxySlots[bodyID] = NullNode;
+}
+
+void sas::SpatialHashGrid::Build(float cellSize) noexcept
+{
+    gridded.clear();
+    oversized.clear();
+    gridProxies.clear();
+    invCellSize = 1.f / cellSize;
+
+    for (uint32_t i = 0; i < proxies.size(); ++i)
+    {
+        const AABB &aabb = proxies[i].aabb;
+        int64_t spanX = int64_t{CellCoord(aabb.maxX)} - CellCoord(aabb.minX) + 1;
+        int64_t spanY = int64_t{CellCoord(aabb.maxY)} - CellCoord(aabb.minY) + 1;
+
+        if (spanX * spanY > MaxCellsPerProxy)
+            oversized.push_back(proxies[i]);
+        else
+            gridded.push_back(i);
+    }
+
+    // About two buckets per body keeps the chains short without touching much memory
+    uint32_t bucketCount = std::bit_ceil(static_cast<uint32_t>(std::max<size_t>(gridded.size() * 2, 16)));
+    bucketMask = bucketCount - 1;
+    bucketStart.assign(bucketCount + 1, 0);
+
+    // Counting sort, count every bucket, turn the counts into bucket ends,
+    // then fill each bucket back to front so the ends become the starts
+    for (uint32_t i : gridded)
+    {
+        const AABB &aabb = proxies[i].aabb;
+        int32_t minX = CellCoord(aabb.minX), maxX = CellCoord(aabb.maxX);
+        int32_t minY = CellCoord(aabb.minY), maxY = CellCoord(aabb.maxY);
+
+        for (int32_t y = minY; y <= maxY; ++y)
+        {
+            for (int32_t x = minX; x <= maxX; ++x)
+                ++bucketStart[Bucket(x, y)];
+        }
+    }
+
+    uint32_t total = 0;
+    for (uint32_t b = 0; b < bucketCount; ++b)
+    {
+        total += bucketStart[b];
+        bucketStart[b] = total;
+    }
+    bucketStart[bucketCount] = total;
+
+    entries.resize(total);
+
+    for (uint32_t i : gridded)
+    {
+        const CellEntry &proxy = proxies[i];
+        const AABB &aabb = proxy.aabb;
+        int32_t minX = CellCoord(aabb.minX), maxX = CellCoord(aabb.maxX);
+        int32_t minY = CellCoord(aabb.minY), maxY = CellCoord(aabb.maxY);
+
+        for (int32_t y = minY; y <= maxY; ++y)
+        {
+            for (int32_t x = minX; x <= maxX; ++x)
+                entries[--bucketStart[Bucket(x, y)]] = {aabb, x, y, proxy.bodyID, proxy.collisionMask};
+        }
+    }
+
+    if (oversized.empty())
+        return;
+
+    for (uint32_t i : gridded)
+    {
+        gridProxies.push_back(proxies[i]);
+    }
+
+    auto byMinX = [](const CellEntry &a, const CellEntry &b)
+    { return a.aabb.minX < b.aabb.minX; };
+
+    std::sort(oversized.begin(), oversized.end(), byMinX);
+    std::sort(gridProxies.begin(), gridProxies.end(), byMinX);
+}
+
+// Two boxes share every cell their overlap touches, the pair is only
+// reported by the cell holding the min corner of the overlap
+void sas::SpatialHashGrid::FindAllPairs(std::vector<BroadPair> &pairs) const noexcept
+{
+    for (uint32_t bucket = 0; bucket + 1 < bucketStart.size(); ++bucket)
+    {
+        uint32_t end = bucketStart[bucket + 1];
+
+        for (uint32_t i = bucketStart[bucket]; i < end; ++i)
+        {
+            const CellEntry &a = entries[i];
+
+            for (uint32_t j = i + 1; j < end; ++j)
+            {
+                const CellEntry &b = entries[j];
+                if (b.cellX != a.cellX || b.cellY != a.cellY)
+                    continue;
+
+                if (!AABBOverlap(a.aabb, b.aabb) || !CanCollide(a.collisionMask, b.collisionMask))
+                    continue;
+
+                if (CellCoord(std::max(a.aabb.minX, b.aabb.minX)) != a.cellX ||
+                    CellCoord(std::max(a.aabb.minY, b.aabb.minY)) != a.cellY)
+                    continue;
+
+                pairs.push_back({std::min(a.bodyID, b.bodyID), std::max(a.bodyID, b.bodyID)});
+            }
+        }
+    }
+
+    auto test = [&pairs](const CellEntry &a, const CellEntry &b)
+    {
+        if (AABBOverlap(a.aabb, b.aabb) && CanCollide(a.collisionMask, b.collisionMask))
+            pairs.push_back({std::min(a.bodyID, b.bodyID), std::max(a.bodyID, b.bodyID)});
+    };
+
+    auto minXBelow = [](const CellEntry &e, float x)
+    { return e.aabb.minX < x; };
+
+    auto minXAbove = [](float x, const CellEntry &e)
+    { return x < e.aabb.minX; };
+
+    // Two boxes overlapping on x have one minX inside the other box, each pair is found
+    // from the box whose minX is lower, ties go to the oversized one
+    for (size_t i = 0; i < oversized.size(); ++i)
+    {
+        const CellEntry &a = oversized[i];
+
+        for (size_t j = i + 1; j < oversized.size() && oversized[j].aabb.minX <= a.aabb.maxX; ++j)
+            test(a, oversized[j]);
+
+        auto first = std::lower_bound(gridProxies.begin(), gridProxies.end(), a.aabb.minX, minXBelow);
+        for (auto it = first; it != gridProxies.end() && it->aabb.minX <= a.aabb.maxX; ++it)
+            test(a, *it);
+    }
+
+    for (const CellEntry &b : gridProxies)
+    {
+        auto first = std::upper_bound(oversized.begin(), oversized.end(), b.aabb.minX, minXAbove);
+        for (auto it = first; it != oversized.end() && it->aabb.minX <= b.aabb.maxX; ++it)
+            test(*it, b);
+    }
+}
+
+void sas::SpatialHashGrid::Clear() noexcept
+{
+    proxies.clear();
+    proxySlots.clear();
+    gridded.clear();
+    entries.clear();
+    oversized.clear();
+    gridProxies.clear();
+    bucketStart.clear();
+    bucketMask = 0;
+}
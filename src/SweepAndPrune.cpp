@@ -0,0 +1,369 @@
+#include "SweepAndPrune.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+void sas::SweepAndPrune::SetProxy(uint32_t bodyID, const AABB &aabb, uint32_t collisionMask) noexcept
+{
+    if (bodyID >= proxies.size())
+    {
+        proxies.resize(bodyID + 1, Proxy{});
+        partners.resize(bodyID + 1);
+        activeSlot.resize(bodyID + 1);
+    }
+
+    Proxy &proxy = proxies[bodyID];
+
+    // y and the masks take effect now, so overlaps starting in x during Update are tested against where everything ends up
+    if (proxy.present)
+    {
+        bool movedY = proxy.aabb.minY < aabb.minY || proxy.aabb.minY > aabb.minY ||
+                      proxy.aabb.maxY < aabb.maxY || proxy.aabb.maxY > aabb.maxY;
+
+        if (movedY || proxy.collisionMask != collisionMask)
+            rechecked.push_back(bodyID);
+    }
+
+    proxy.aabb = aabb;
+    proxy.collisionMask = collisionMask;
+
+    if (proxy.stamp == stamp)
+        return;
+
+    proxy.stamp = stamp;
+
+    if (proxy.present)
+        moved.push_back(bodyID);
+    else
+        newcomers.push_back(bodyID);
+}
+
+void sas::SweepAndPrune::Update() noexcept
+{
+    swapCount = 0;
+    addedEvents.clear();
+    removedEvents.clear();
+
+    for (uint32_t id : moved)
+    {
+        const Proxy &proxy = proxies[id];
+
+        // Removed after it was given its box
+        if (!proxy.present)
+            continue;
+
+        endpoints[proxy.index[0]].value = proxy.aabb.minX;
+        endpoints[proxy.index[1]].value = proxy.aabb.maxX;
+
+        // The ends that grew go first, so the min never has to pass its own max
+        SortDown(proxy.index[0]);
+        SortUp(proxy.index[1]);
+        SortUp(proxy.index[0]);
+        SortDown(proxy.index[1]);
+    }
+
+    // Moving in y or changing layers starts and ends pairs without any swap
+    for (uint32_t id : rechecked)
+    {
+        if (!proxies[id].present)
+            continue;
+
+        for (uint32_t slot = 0; slot < partners[id].size(); ++slot)
+            Test(id, slot);
+    }
+
+    // Bodies removed before the Update are dropped, one added, removed and added again is listed twice and goes in once
+    std::erase_if(newcomers, [this](uint32_t id)
+                  {
+                      Proxy &proxy = proxies[id];
+                      if (proxy.present || proxy.stamp != stamp)
+                          return true;
+
+                      proxy.stamp = 0;
+                      return false; });
+
+    if (newcomers.size() > InsertionSortLimit)
+    {
+        InsertBulk();
+    }
+    else
+    {
+        for (uint32_t id : newcomers)
+            Insert(id);
+    }
+
+    moved.clear();
+    rechecked.clear();
+    newcomers.clear();
+
+    if (++stamp == 0)
+        stamp = 1;
+
+    // A pair can start and end more than once in one Update,
+    // the differences of the two event multisets are what changed
+    auto byKey = [](const BroadPair &a, const BroadPair &b)
+    { return PairKey(a) < PairKey(b); };
+
+    std::sort(addedEvents.begin(), addedEvents.end(), byKey);
+    std::sort(removedEvents.begin(), removedEvents.end(), byKey);
+
+    addedPairs.clear();
+    removedPairs.clear();
+    std::set_difference(addedEvents.begin(), addedEvents.end(), removedEvents.begin(), removedEvents.end(),
+                        std::back_inserter(addedPairs), byKey);
+    std::set_difference(removedEvents.begin(), removedEvents.end(), addedEvents.begin(), addedEvents.end(),
+                        std::back_inserter(removedPairs), byKey);
+}
+
+// Swaps the endpoints at index and index + 1
+// A min and a max of two bodies trading places is the only thing that changes whether they overlap in x
+void sas::SweepAndPrune::Cross(uint32_t index) noexcept
+{
+    std::swap(endpoints[index], endpoints[index + 1]);
+
+    const Endpoint lower = endpoints[index];
+    const Endpoint upper = endpoints[index + 1];
+    uint32_t a = lower.data >> 1;
+    uint32_t b = upper.data >> 1;
+
+    proxies[a].index[lower.data & 1] = index;
+    proxies[b].index[upper.data & 1] = index + 1;
+    ++swapCount;
+
+    if ((lower.data & 1) == (upper.data & 1) || a == b)
+        return;
+
+    // A min that went below a max starts an overlap when the other two ends are in order,
+    // a max that went below a min ends one when they were
+    if (lower.data & 1)
+    {
+        if (proxies[a].index[0] < proxies[b].index[1])
+            Unlink(a, b);
+    }
+    else if (proxies[b].index[0] < proxies[a].index[1])
+    {
+        Link(a, b);
+    }
+}
+
+void sas::SweepAndPrune::SortDown(uint32_t index) noexcept
+{
+    for (; index > 0 && Less(endpoints[index], endpoints[index - 1]); --index)
+        Cross(index - 1);
+}
+
+void sas::SweepAndPrune::SortUp(uint32_t index) noexcept
+{
+    for (; index + 1 < endpoints.size() && Less(endpoints[index + 1], endpoints[index]); ++index)
+        Cross(index);
+}
+
+void sas::SweepAndPrune::Link(uint32_t a, uint32_t b) noexcept
+{
+    uint32_t slotA = static_cast<uint32_t>(partners[a].size());
+    uint32_t slotB = static_cast<uint32_t>(partners[b].size());
+
+    partners[a].push_back({b, slotB, false});
+    partners[b].push_back({a, slotA, false});
+
+    Test(a, slotA);
+}
+
+void sas::SweepAndPrune::Unlink(uint32_t a, uint32_t b) noexcept
+{
+    const std::vector<Partner> &list = partners[a];
+
+    for (uint32_t slot = 0; slot < list.size(); ++slot)
+    {
+        if (list[slot].bodyID == b)
+        {
+            Detach(a, slot, true);
+            return;
+        }
+    }
+}
+
+// Drops both sides of the overlap, a pair that was on ends
+void sas::SweepAndPrune::Detach(uint32_t bodyID, uint32_t slot, bool report) noexcept
+{
+    Partner partner = partners[bodyID][slot];
+
+    if (partner.paired)
+    {
+        --pairCount;
+
+        if (report)
+            removedEvents.push_back({std::min(bodyID, partner.bodyID), std::max(bodyID, partner.bodyID)});
+    }
+
+    ErasePartner(partner.bodyID, partner.mirror);
+    ErasePartner(bodyID, slot);
+}
+
+// Swap and pop, the moved entry's other side is told where it went
+void sas::SweepAndPrune::ErasePartner(uint32_t bodyID, uint32_t slot) noexcept
+{
+    std::vector<Partner> &list = partners[bodyID];
+
+    if (slot + 1 < list.size())
+    {
+        list[slot] = list.back();
+        partners[list[slot].bodyID][list[slot].mirror].mirror = slot;
+    }
+    list.pop_back();
+}
+
+// The two overlap in x, the pair is on while y and the masks agree
+void sas::SweepAndPrune::Test(uint32_t bodyID, uint32_t slot) noexcept
+{
+    Partner &partner = partners[bodyID][slot];
+    const Proxy &proxy = proxies[bodyID];
+    const Proxy &other = proxies[partner.bodyID];
+
+    bool paired = OverlapY(proxy, other) && CanCollide(proxy.collisionMask, other.collisionMask);
+    if (paired == partner.paired)
+        return;
+
+    partner.paired = paired;
+    partners[partner.bodyID][partner.mirror].paired = paired;
+
+    BroadPair pair{std::min(bodyID, partner.bodyID), std::max(bodyID, partner.bodyID)};
+    if (paired)
+    {
+        ++pairCount;
+        addedEvents.push_back(pair);
+    }
+    else
+    {
+        --pairCount;
+        removedEvents.push_back(pair);
+    }
+}
+
+// The max goes in first and sorts down without meeting anything, then the min
+// follows it from the end and every max it passes before its own max is a partner
+void sas::SweepAndPrune::Insert(uint32_t bodyID) noexcept
+{
+    Proxy &proxy = proxies[bodyID];
+    proxy.present = true;
+
+    uint32_t end = static_cast<uint32_t>(endpoints.size());
+
+    // The min counts as past the end until it is pushed there
+    proxy.index[0] = end + 1;
+    proxy.index[1] = end;
+    endpoints.push_back({proxy.aabb.maxX, (bodyID << 1) | 1});
+    SortDown(end);
+
+    endpoints.push_back({proxy.aabb.minX, bodyID << 1});
+    SortDown(end + 1);
+}
+
+// Appends every newcomer, sorts and sweeps once for the partners they have
+void sas::SweepAndPrune::InsertBulk() noexcept
+{
+    for (uint32_t id : newcomers)
+    {
+        Proxy &proxy = proxies[id];
+        proxy.present = true;
+        proxy.fresh = true;
+
+        endpoints.push_back({proxy.aabb.minX, id << 1});
+        endpoints.push_back({proxy.aabb.maxX, (id << 1) | 1});
+    }
+
+    std::sort(endpoints.begin(), endpoints.end(), Less);
+
+    for (uint32_t i = 0; i < endpoints.size(); ++i)
+        proxies[endpoints[i].data >> 1].index[endpoints[i].data & 1] = i;
+
+    // Every body still active when a min is reached overlaps it in x
+    active.clear();
+
+    for (const Endpoint &endpoint : endpoints)
+    {
+        uint32_t id = endpoint.data >> 1;
+
+        if (endpoint.data & 1)
+        {
+            uint32_t slot = activeSlot[id];
+
+            active[slot] = active.back();
+            activeSlot[active[slot]] = slot;
+            active.pop_back();
+            continue;
+        }
+
+        // Bodies already in have their partners
+        for (uint32_t other : active)
+        {
+            if (proxies[id].fresh || proxies[other].fresh)
+                Link(id, other);
+        }
+
+        activeSlot[id] = static_cast<uint32_t>(active.size());
+        active.push_back(id);
+    }
+
+    for (uint32_t id : newcomers)
+        proxies[id].fresh = false;
+}
+
+void sas::SweepAndPrune::Drop(uint32_t bodyID, bool report) noexcept
+{
+    while (!partners[bodyID].empty())
+        Detach(bodyID, static_cast<uint32_t>(partners[bodyID].size()) - 1, report);
+
+    Proxy &proxy = proxies[bodyID];
+    proxy.present = false;
+
+    uint32_t first = proxy.index[0];
+    endpoints.erase(endpoints.begin() + proxy.index[1]);
+    endpoints.erase(endpoints.begin() + first);
+
+    for (uint32_t i = first; i < endpoints.size(); ++i)
+        proxies[endpoints[i].data >> 1].index[endpoints[i].data & 1] = i;
+}
+
+void sas::SweepAndPrune::Remove(uint32_t bodyID) noexcept
+{
+    if (bodyID >= proxies.size())
+        return;
+
+    // A box given before the Remove is forgotten with it
+    if (proxies[bodyID].present)
+        Drop(bodyID, false);
+
+    proxies[bodyID].stamp = 0;
+}
+
+void sas::SweepAndPrune::GetPairs(std::vector<BroadPair> &pairs) const noexcept
+{
+    for (uint32_t id = 0; id < partners.size(); ++id)
+    {
+        for (const Partner &partner : partners[id])
+        {
+            if (partner.paired && id < partner.bodyID)
+                pairs.push_back({id, partner.bodyID});
+        }
+    }
+}
+
+void sas::SweepAndPrune::Clear() noexcept
+{
+    endpoints.clear();
+    proxies.clear();
+    partners.clear();
+    pairCount = 0;
+    addedEvents.clear();
+    removedEvents.clear();
+    addedPairs.clear();
+    removedPairs.clear();
+    moved.clear();
+    rechecked.clear();
+    newcomers.clear();
+    active.clear();
+    activeSlot.clear();
+    stamp = 1;
+    swapCount = 0;
+}
@@ -0,0 +1,180 @@
+#include "WideBVH.hpp"
+
+#include <algorithm>
+#include <limits>
+
+void sas::WideBVH::Build(const AABBTree &tree) noexcept
+{
+    nodes.clear();
+    parentSlots.clear();
+    leafSlots.assign(tree.leafMap.size(), NullNode);
+    leafCount = 0;
+    depth = 0;
+
+    if (tree.root == NullNode)
+        return;
+
+    const Node &root = tree.nodes[tree.root];
+    if (!root.isLeaf())
+    {
+        BuildNode(tree, tree.root, 1);
+        return;
+    }
+
+    // Single body, one node with a single lane
+    WideNode node;
+    for (int i = 0; i < 4; ++i)
+    {
+        node.minX[i] = node.minY[i] = std::numeric_limits<float>::max();
+        node.maxX[i] = node.maxY[i] = std::numeric_limits<float>::lowest();
+        node.children[i] = NullNode;
+        node.collisionMasks[i] = 0;
+    }
+
+    SetLane(node, 0, root.aabb, root.collisionMask);
+    node.children[0] = static_cast<uint32_t>(root.objectID) | WideLeafBit;
+
+    nodes.push_back(node);
+    parentSlots.push_back(NullNode);
+    leafSlots[root.objectID] = 0;
+    leafCount = 1;
+    depth = 1;
+}
+
+// Collapses binaryNode and up to two levels below it into one node,
+// always opening the biggest internal lane first
+uint32_t sas::WideBVH::BuildNode(const AABBTree &tree, uint32_t binaryNode, int level) noexcept
+{
+    depth = std::max(depth, level);
+
+    uint32_t lanes[4];
+    int laneCount = 2;
+
+    lanes[0] = tree.nodes[binaryNode].children[0];
+    lanes[1] = tree.nodes[binaryNode].children[1];
+
+    while (laneCount < 4)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+
+        for (int i = 0; i < laneCount; ++i)
+        {
+            const Node &lane = tree.nodes[lanes[i]];
+            if (lane.isLeaf())
+                continue;
+
+            float area = GetAreaAABB(lane.aabb);
+            if (area > bestArea)
+            {
+                bestArea = area;
+                best = i;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        const Node &opened = tree.nodes[lanes[best]];
+        lanes[best] = opened.children[0];
+        lanes[laneCount++] = opened.children[1];
+    }
+
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    parentSlots.push_back(NullNode);
+
+    WideNode node;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (i >= laneCount)
+        {
+            node.minX[i] = node.minY[i] = std::numeric_limits<float>::max();
+            node.maxX[i] = node.maxY[i] = std::numeric_limits<float>::lowest();
+            node.children[i] = NullNode;
+            node.collisionMasks[i] = 0;
+            continue;
+        }
+
+        const Node &lane = tree.nodes[lanes[i]];
+        SetLane(node, i, lane.aabb, lane.collisionMask);
+
+        uint32_t slot = (index << 2) | static_cast<uint32_t>(i);
+
+        if (lane.isLeaf())
+        {
+            node.children[i] = static_cast<uint32_t>(lane.objectID) | WideLeafBit;
+            leafSlots[lane.objectID] = slot;
+            ++leafCount;
+        }
+        else
+        {
+            node.children[i] = BuildNode(tree, lanes[i], level + 1);
+            parentSlots[node.children[i]] = slot;
+        }
+    }
+
+    // The recursion may have grown the pool
+    nodes[index] = node;
+
+    return index;
+}
+
+void sas::WideBVH::SetLane(WideNode &node, int lane, const AABB &aabb, uint32_t collisionMask) noexcept
+{
+    node.minX[lane] = aabb.minX;
+    node.minY[lane] = aabb.minY;
+    node.maxX[lane] = aabb.maxX;
+    node.maxY[lane] = aabb.maxY;
+    node.collisionMasks[lane] = collisionMask;
+}
+
+bool sas::WideBVH::Refit(const AABBTree &tree, std::span<const uint32_t> bodyIDs) noexcept
+{
+    for (uint32_t id : bodyIDs)
+    {
+        // Removed since it moved
+        if (!tree.Contains(id))
+            continue;
+
+        if (id >= leafSlots.size() || leafSlots[id] == NullNode)
+            return false;
+
+        const Node &leaf = tree.nodes[tree.leafMap[id]];
+        uint32_t slot = leafSlots[id];
+        SetLane(nodes[slot >> 2], static_cast<int>(slot & 3), leaf.aabb, leaf.collisionMask);
+
+        // Every node above takes the union of its lanes, empty lanes are inverted boxes and add nothing
+        // Once a parent's lane comes out the same, everything above it is already right
+        for (uint32_t node = slot >> 2; parentSlots[node] != NullNode; node = parentSlots[node] >> 2)
+        {
+            const WideNode &child = nodes[node];
+
+            AABB box{std::min(std::min(child.minX[0], child.minX[1]), std::min(child.minX[2], child.minX[3])),
+                     std::min(std::min(child.minY[0], child.minY[1]), std::min(child.minY[2], child.minY[3])),
+                     std::max(std::max(child.maxX[0], child.maxX[1]), std::max(child.maxX[2], child.maxX[3])),
+                     std::max(std::max(child.maxY[0], child.maxY[1]), std::max(child.maxY[2], child.maxY[3]))};
+            uint32_t collisionMask = child.collisionMasks[0] | child.collisionMasks[1] | child.collisionMasks[2] | child.collisionMasks[3];
+
+            WideNode &parent = nodes[parentSlots[node] >> 2];
+            int lane = static_cast<int>(parentSlots[node] & 3);
+            AABB current{parent.minX[lane], parent.minY[lane], parent.maxX[lane], parent.maxY[lane]};
+
+            if (AABBContains(box, current) && AABBContains(current, box) && parent.collisionMasks[lane] == collisionMask)
+                break;
+
+            SetLane(parent, lane, box, collisionMask);
+        }
+    }
+
+    return true;
+}
+
+void sas::WideBVH::Clear() noexcept
+{
+    nodes.clear();
+    parentSlots.clear();
+    leafSlots.clear();
+    leafCount = 0;
+    depth = 0;
+}
@@ -25,12 +25,27 @@ int main()
     InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Physics Engine");
     SetTargetFPS(60);
 
+    // Platforms get a layer of their own so picking only ever hits the thrown bodies
+    constexpr uint32_t PlatformLayer = sas::Flags::Layer2;
+    constexpr uint32_t BodyLayer = sas::Flags::Layer1;
+
     sas::PhysicsWorld world({0, 0, SCREEN_WIDTH, SCREEN_HEIGHT});
     sas::PhysicsSettings &settings = world.settings;
     Entity *currentBody = nullptr;
 
     std::vector<Entity> entities;
 
+    // Index into entities of every body id, kept up to date when entities move around
+    std::vector<size_t> entityOf;
+    auto track = [&entities, &entityOf](size_t index)
+    {
+        uint32_t id = entities[index].bodyHandle->bodyID;
+        if (entityOf.size() <= id)
+            entityOf.resize(id + 1);
+
+        entityOf[id] = index;
+    };
+
     sas::Transform t;
     t.position = {470, 230};
     t.scale = {1, 1};
@@ -53,8 +68,13 @@ int main()
     Entity firstEntity{{}, firstBH, MAROON, sas::ShapeType::Box};
     Entity seccondEntity{{}, seccondBh, MAROON, sas::ShapeType::Box};
 
+    firstBH.SetLayer(PlatformLayer);
+    seccondBh.SetLayer(PlatformLayer);
+
     entities.push_back(firstEntity);
     entities.push_back(seccondEntity);
+    track(0);
+    track(1);
     entities[0].bodyHandle->kinematics = k;
 
     auto lambda = [](const sas::AABB &b, bool isLeaf)
@@ -93,12 +113,16 @@ int main()
                 sas::BodyHandle bh = world.CreateBody(shapeType ? sas::Shape::MakeCircle(25) : sas::Shape::MakeBox(25, 25), t1);
 
                 Entity temp{{}, bh, MAROON, shapeType ? sas::ShapeType::Circle : sas::ShapeType::Box};
+                // Mask2 so they still land on the platforms
+                temp.bodyHandle.SetCollision(BodyLayer, sas::Flags::Mask1 | sas::Flags::Mask2);
 
+                // Out of the collision pool, so QueryPoint can't pick it either
                 if (collision)
                 {
                     temp.bodyHandle.SetCollisionOff();
                 }
                 entities.push_back(temp);
+                track(entities.size() - 1);
                 currentBody = &entities.back();
             }
         }
@@ -120,22 +144,20 @@ int main()
         {
             const auto &[x, y] = GetMousePosition();
 
-            size_t ind = 0;
-            for (size_t i = 0; i < entities.size(); ++i)
+            if (std::optional<uint32_t> picked = world.QueryPoint({x, y}, BodyLayer))
             {
-                auto &entity = entities[i];
-                if (CheckCollisionPointCircle({x, y}, {entity.bodyHandle->transform.position.x, entity.bodyHandle->transform.position.y}, entity.bodyHandle->shape.radius))
-                {
+                size_t index = entityOf[*picked];
+
+                world.RemoveBody(*picked);
+
+                entities[index] = entities.back();
+                entities.pop_back();
 
-                    ind = i;
-                    break;
+                if (index < entities.size())
+                {
+                    track(index);
                 }
             }
-
-            world.RemoveBody(entities[ind].bodyHandle->bodyID);
-            
-            entities[ind] = entities.back();
-            entities.pop_back();
         }
 
         if (IsMouseButtonReleased(MOUSE_BUTTON_RIGHT))
@@ -159,6 +181,7 @@ int main()
         {
             world.Clear();
             entities.clear();
+            entityOf.clear();
         }
 
         if (IsKeyPressed(KEY_Q))
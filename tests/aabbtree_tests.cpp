@@ -0,0 +1,1246 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+#include "AABBTree.hpp"
+#include "WideBVH.hpp"
+#include "QuantizedBVH.hpp"
+#include "SpatialHashGrid.hpp"
+#include "SweepAndPrune.hpp"
+#include "HierarchicalGrid.hpp"
+
+static sas::AABB MakeAABB(float x, float y, float half)
+{
+    return {x - half, y - half, x + half, y + half};
+}
+
+TEST(AABBTreeTest, QueryFindsOverlappingLeaves)
+{
+    sas::AABBTree tree;
+
+    tree.insert(0, MakeAABB(0, 0, 5));
+    tree.insert(1, MakeAABB(8, 0, 5));
+    tree.insert(2, MakeAABB(100, 100, 5));
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(4, 0, 1), results);
+
+    std::sort(results.begin(), results.end());
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_EQ(results[0], 0);
+    EXPECT_EQ(results[1], 1);
+}
+
+TEST(AABBTreeTest, RemovedLeavesAreNotReported)
+{
+    sas::AABBTree tree;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        tree.insert(i, MakeAABB(static_cast<float>(i) * 3.f, 0, 2));
+    }
+
+    for (uint32_t i = 0; i < 16; i += 2)
+    {
+        tree.remove(i);
+    }
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(0, 0, 1000), results);
+
+    ASSERT_EQ(results.size(), 8);
+    for (uint32_t id : results)
+    {
+        EXPECT_EQ(id % 2, 1);
+    }
+
+    // Unknown ids are ignored
+    tree.remove(1000);
+}
+
+TEST(AABBTreeTest, ClearedTreeCanBeRefilled)
+{
+    sas::AABBTree tree;
+
+    for (uint32_t i = 0; i < 32; ++i)
+    {
+        tree.insert(i, MakeAABB(static_cast<float>(i), 0, 1));
+    }
+
+    tree.Clear();
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(0, 0, 1000), results);
+    EXPECT_TRUE(results.empty());
+
+    tree.insert(7, MakeAABB(0, 0, 1));
+    tree.Query(MakeAABB(0, 0, 1000), results);
+
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0], 7);
+}
+
+TEST(AABBTreeTest, StaysBalancedUnderChurn)
+{
+    sas::AABBTree tree;
+
+    // Sorted insertion degenerates an unbalanced tree into a list
+    for (uint32_t i = 0; i < 1024; ++i)
+    {
+        tree.insert(i, MakeAABB(static_cast<float>(i) * 4.f, 0, 1));
+    }
+
+    EXPECT_LE(tree.GetMaxBalance(), 1);
+    EXPECT_LE(tree.GetHeight(), 20);
+
+    for (uint32_t i = 0; i < 1024; i += 3)
+    {
+        tree.remove(i);
+    }
+
+    EXPECT_LE(tree.GetMaxBalance(), 1);
+    EXPECT_LE(tree.GetHeight(), 20);
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(0, 0, 10000), results);
+    EXPECT_EQ(results.size(), 1024 - 342);
+}
+
+TEST(AABBTreeTest, InsertStrategiesAgreeOnQueries)
+{
+    sas::AABBTree sah(sas::InsertStrategy::BranchAndBound);
+    sas::AABBTree greedy(sas::InsertStrategy::Greedy);
+
+    uint32_t seed = 12345;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (uint32_t i = 0; i < 512; ++i)
+    {
+        sas::AABB box = MakeAABB(next() * 1000.f, next() * 1000.f, 1.f + next() * 10.f);
+        sah.insert(i, box);
+        greedy.insert(i, box);
+    }
+
+    for (int q = 0; q < 64; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 1000.f, next() * 1000.f, 50.f);
+
+        std::vector<uint32_t> a, b;
+        sah.Query(query, a);
+        greedy.Query(query, b);
+
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        EXPECT_EQ(a, b);
+    }
+
+    EXPECT_LE(sah.GetHeight(), 24);
+}
+
+TEST(AABBTreeTest, SmallMovesRefitInPlace)
+{
+    sas::AABBTree tree;
+    tree.SetUpdateMode(sas::UpdateMode::Adaptive, 0.5f);
+
+    sas::Body body{};
+    body.shape = sas::Shape::MakeCircle(10.f);
+    body.transform.position = {100, 100};
+    body.bodyID = 0;
+
+    tree.insert(0, sas::ComputeFatAABB(body, 2.f));
+    tree.insert(1, MakeAABB(500, 500, 10));
+
+    // Escapes the fat box by a little
+    body.transform.position = {103, 100};
+    tree.UpdateObject(body, 2.f);
+
+    EXPECT_EQ(tree.GetUpdateStats().refits, 1);
+    EXPECT_EQ(tree.GetUpdateStats().reinserts, 0);
+
+    // Teleport
+    body.transform.position = {300, 100};
+    tree.UpdateObject(body, 2.f);
+
+    EXPECT_EQ(tree.GetUpdateStats().refits, 1);
+    EXPECT_EQ(tree.GetUpdateStats().reinserts, 1);
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(300, 100, 1), results);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0], 0);
+
+    tree.ResetUpdateStats();
+    EXPECT_EQ(tree.GetUpdateStats().refits, 0);
+}
+
+TEST(AABBTreeTest, SweptAABBOnlyGrowsAlongDisplacement)
+{
+    sas::AABB tight = MakeAABB(100, 100, 10);
+
+    sas::AABB swept = sas::ComputeSweptAABB(tight, {30, -6}, 2.f);
+    EXPECT_FLOAT_EQ(swept.minX, 88.f);
+    EXPECT_FLOAT_EQ(swept.maxX, 142.f);
+    EXPECT_FLOAT_EQ(swept.minY, 82.f);
+    EXPECT_FLOAT_EQ(swept.maxY, 112.f);
+
+    // A body moving right stays inside its swept box for the frames it was stretched for
+    sas::AABBTree tree;
+
+    sas::Body body{};
+    body.shape = sas::Shape::MakeCircle(10.f);
+    body.transform.position = {100, 100};
+    body.transform.rotation = 0.f;
+    body.bodyID = 0;
+
+    sas::AABB fat = sas::ComputeSweptAABB(sas::ComputeTightAABB(body), {30, 0}, 2.f);
+    tree.insert(0, fat);
+
+    for (int frame = 0; frame < 3; ++frame)
+    {
+        body.transform.position.x += 10.f;
+        sas::AABB moved = sas::ComputeTightAABB(body);
+        tree.UpdateObject(body.bodyID, moved, sas::ComputeSweptAABB(moved, {30, 0}, 2.f));
+    }
+
+    EXPECT_EQ(tree.GetUpdateStats().refits + tree.GetUpdateStats().reinserts, 0);
+
+    body.transform.position.x += 10.f;
+    sas::AABB moved = sas::ComputeTightAABB(body);
+    tree.UpdateObject(body.bodyID, moved, sas::ComputeSweptAABB(moved, {30, 0}, 2.f));
+
+    EXPECT_EQ(tree.GetUpdateStats().refits + tree.GetUpdateStats().reinserts, 1);
+}
+
+TEST(AABBTreeTest, FindAllPairsMatchesBruteForce)
+{
+    sas::AABBTree tree;
+    std::vector<sas::AABB> boxes;
+
+    uint32_t seed = 777;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (uint32_t i = 0; i < 300; ++i)
+    {
+        boxes.push_back(MakeAABB(next() * 400.f, next() * 400.f, 2.f + next() * 12.f));
+        tree.insert(i, boxes.back());
+    }
+
+    std::vector<sas::BroadPair> pairs;
+    tree.FindAllPairs(pairs);
+
+    std::vector<std::pair<uint32_t, uint32_t>> found;
+    for (const auto &pair : pairs)
+    {
+        ASSERT_LT(pair.bodyA, pair.bodyB);
+        found.emplace_back(pair.bodyA, pair.bodyB);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> expected;
+    for (uint32_t i = 0; i < boxes.size(); ++i)
+    {
+        for (uint32_t j = i + 1; j < boxes.size(); ++j)
+        {
+            if (sas::AABBOverlap(boxes[i], boxes[j]))
+                expected.emplace_back(i, j);
+        }
+    }
+
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+
+    EXPECT_EQ(found, expected);
+}
+
+TEST(SpatialHashGridTest, FindsSamePairsAsTree)
+{
+    sas::AABBTree tree;
+    sas::SpatialHashGrid grid;
+
+    uint32_t seed = 4242;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    // Negative coordinates, boxes much bigger than a cell and a few layers
+    for (uint32_t i = 0; i < 400; ++i)
+    {
+        float half = i % 25 == 0 ? 40.f : 2.f + next() * 10.f;
+        sas::AABB box = MakeAABB(next() * 500.f - 250.f, next() * 500.f - 250.f, half);
+        uint32_t mask = i % 7 == 0 ? (sas::Flags::Layer1 | (sas::Flags::Layer1 << 16)) : sas::Flags::LayerAll | sas::Flags::MaskAll;
+
+        tree.insert(i, box);
+        tree.SetCollisionMask(i, mask);
+        grid.SetProxy(i, box, mask);
+    }
+
+    // Removed bodies leave the store, the last one takes their slot
+    for (uint32_t i = 400; i < 410; ++i)
+        grid.SetProxy(i, MakeAABB(0.f, 0.f, 5.f), sas::Flags::LayerAll | sas::Flags::MaskAll);
+    for (uint32_t i = 400; i < 410; ++i)
+        grid.RemoveProxy(i);
+
+    EXPECT_EQ(grid.GetProxyCount(), 400u);
+    EXPECT_FALSE(grid.Contains(405));
+
+    std::vector<sas::BroadPair> expected;
+    tree.FindAllPairs(expected);
+
+    for (float cellSize : {4.f, 16.f, 64.f})
+    {
+        grid.Build(cellSize);
+
+        std::vector<sas::BroadPair> found;
+        grid.FindAllPairs(found);
+
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+
+        EXPECT_EQ(found, expected) << "cell size " << cellSize;
+    }
+}
+
+TEST(SpatialHashGridTest, HandlesHugeAndDistantBoxes)
+{
+    sas::AABBTree tree;
+    sas::SpatialHashGrid grid;
+
+    auto add = [&tree, &grid](uint32_t id, const sas::AABB &box)
+    {
+        tree.insert(id, box);
+        grid.SetProxy(id, box, sas::Flags::LayerAll | sas::Flags::MaskAll);
+    };
+
+    // A box covering most of the float range, one far past the int32 cell range and a few ordinary ones
+    add(0, sas::AABB{-1e30f, -1e30f, 1e30f, 1e30f});
+    add(1, MakeAABB(1e20f, -1e20f, 5.f));
+    add(2, MakeAABB(1e20f, -1e20f, 3.f));
+    for (uint32_t i = 3; i < 20; ++i)
+        add(i, MakeAABB(static_cast<float>(i) * 6.f, 0.f, 4.f));
+    add(20, sas::AABB{-1e6f, -2.f, 1e6f, 2.f});
+
+    std::vector<sas::BroadPair> expected;
+    tree.FindAllPairs(expected);
+    std::sort(expected.begin(), expected.end());
+
+    grid.Build(8.f);
+
+    // Only the huge box and the long strip are kept aside, the distant ones stay in a clamped cell
+    EXPECT_EQ(grid.GetOversizedCount(), 2u);
+    EXPECT_LE(grid.GetEntryCount(), 17u * 4u + 2u);
+
+    std::vector<sas::BroadPair> found;
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+}
+
+TEST(HierarchicalGridTest, FindsSamePairsAsTree)
+{
+    sas::AABBTree tree;
+    sas::HierarchicalGrid grid;
+
+    uint32_t seed = 2024;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    // Debris, crates and a few platforms, some on a layer of their own
+    for (uint32_t i = 0; i < 500; ++i)
+    {
+        float x = next() * 2000.f - 1000.f, y = next() * 1000.f;
+        sas::AABB box = i % 50 == 0   ? sas::AABB{x - 400.f, y - 4.f, x + 400.f, y + 4.f}
+                        : i % 5 == 0 ? MakeAABB(x, y, 10.f + next() * 20.f)
+                                     : MakeAABB(x, y, 1.f + next() * 2.f);
+
+        uint32_t mask = i % 3 == 0 ? sas::Flags::Layer2 | (sas::Flags::Layer2 << 16) : sas::Flags::LayerAll | sas::Flags::MaskAll;
+
+        tree.insert(i, box);
+        tree.SetCollisionMask(i, mask);
+        grid.SetProxy(i, box, mask);
+    }
+
+    std::vector<sas::BroadPair> expected;
+    tree.FindAllPairs(expected);
+    std::sort(expected.begin(), expected.end());
+
+    grid.Build(4.f);
+
+    std::vector<sas::BroadPair> found;
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+
+    // Debris on the finest levels, platforms far above them
+    EXPECT_GT(grid.GetLevelCount(0) + grid.GetLevelCount(1), 300);
+    EXPECT_EQ(grid.GetLevelCount(4), 10);
+
+    // Cells so small the crates and platforms do not fit the top level
+    grid.Build(0.00001f);
+    found.clear();
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+
+    // The platforms leave
+    for (uint32_t i = 0; i < 500; i += 50)
+    {
+        tree.remove(i);
+        grid.RemoveProxy(i);
+    }
+
+    EXPECT_EQ(grid.GetProxyCount(), 490u);
+    EXPECT_FALSE(grid.Contains(250));
+
+    expected.clear();
+    tree.FindAllPairs(expected);
+    std::sort(expected.begin(), expected.end());
+
+    grid.Build(4.f);
+    EXPECT_EQ(grid.GetLevelCount(4), 0);
+
+    found.clear();
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+}
+
+TEST(HierarchicalGridTest, HandlesHugeAndDistantBoxes)
+{
+    sas::AABBTree tree;
+    sas::HierarchicalGrid grid;
+
+    auto add = [&tree, &grid](uint32_t id, const sas::AABB &box)
+    {
+        tree.insert(id, box);
+        grid.SetProxy(id, box, sas::Flags::LayerAll | sas::Flags::MaskAll);
+    };
+
+    // Same scene as the SpatialHashGrid case
+    add(0, sas::AABB{-1e30f, -1e30f, 1e30f, 1e30f});
+    add(1, MakeAABB(1e20f, -1e20f, 5.f));
+    add(2, MakeAABB(1e20f, -1e20f, 3.f));
+    for (uint32_t i = 3; i < 20; ++i)
+        add(i, MakeAABB(static_cast<float>(i) * 6.f, 0.f, 4.f));
+    add(20, sas::AABB{-1e6f, -2.f, 1e6f, 2.f});
+
+    std::vector<sas::BroadPair> expected;
+    tree.FindAllPairs(expected);
+    std::sort(expected.begin(), expected.end());
+
+    grid.Build(1.f);
+
+    // Top cells are 4^15 wide, only the huge box is kept aside
+    EXPECT_EQ(grid.GetOversizedCount(), 1u);
+
+    std::vector<sas::BroadPair> found;
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+
+    // Small enough cells push the long strip out as well
+    grid.Build(0.001f);
+    EXPECT_EQ(grid.GetOversizedCount(), 2u);
+
+    found.clear();
+    grid.FindAllPairs(found);
+    std::sort(found.begin(), found.end());
+
+    EXPECT_EQ(found, expected);
+}
+
+TEST(SweepAndPruneTest, TracksPairsAcrossUpdates)
+{
+    sas::AABBTree tree;
+    sas::SweepAndPrune sap;
+
+    uint32_t seed = 99;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    auto maskOf = [](uint32_t i)
+    { return i % 5 == 0 ? sas::Flags::Layer2 | (sas::Flags::Layer2 << 16) : sas::Flags::LayerAll | sas::Flags::MaskAll; };
+
+    // Long in x and short in y, the tree is the reference
+    std::vector<sas::math::Vec2> centers;
+    for (uint32_t i = 0; i < 300; ++i)
+    {
+        centers.push_back({next() * 3000.f, next() * 200.f});
+        tree.insert(i, MakeAABB(centers[i].x, centers[i].y, 8.f));
+        tree.SetCollisionMask(i, maskOf(i));
+        sap.SetProxy(i, MakeAABB(centers[i].x, centers[i].y, 8.f), maskOf(i));
+    }
+
+    std::vector<sas::BroadPair> previous;
+    for (int frame = 0; frame < 10; ++frame)
+    {
+        sap.Update();
+
+        std::vector<sas::BroadPair> expected;
+        tree.FindAllPairs(expected);
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<sas::BroadPair> found;
+        sap.GetPairs(found);
+        std::sort(found.begin(), found.end());
+
+        EXPECT_EQ(found, expected) << "frame " << frame;
+
+        std::vector<sas::BroadPair> added, removed;
+        std::set_difference(expected.begin(), expected.end(), previous.begin(), previous.end(), std::back_inserter(added));
+        std::set_difference(previous.begin(), previous.end(), expected.begin(), expected.end(), std::back_inserter(removed));
+
+        EXPECT_EQ(sap.GetAddedPairs(), added) << "frame " << frame;
+        EXPECT_EQ(sap.GetRemovedPairs(), removed) << "frame " << frame;
+        previous = expected;
+
+        // Small coherent moves, some only in y, plus a body that leaves and one that comes back
+        for (uint32_t i = 0; i < centers.size(); ++i)
+        {
+            if (i % 3 != 0)
+                centers[i].x += (next() - 0.5f) * 10.f;
+            centers[i].y += (next() - 0.5f) * 10.f;
+            if (tree.Contains(i))
+            {
+                tree.remove(i);
+                tree.insert(i, MakeAABB(centers[i].x, centers[i].y, 8.f));
+                sap.SetProxy(i, MakeAABB(centers[i].x, centers[i].y, 8.f), maskOf(i));
+            }
+        }
+
+        uint32_t toggled = static_cast<uint32_t>(frame) * 7;
+        if (frame % 2 == 0)
+        {
+            tree.remove(toggled);
+            sap.Remove(toggled);
+
+            // Remove drops its pairs without a removed event
+            std::erase_if(previous, [toggled](const sas::BroadPair &pair)
+                          { return pair.bodyA == toggled || pair.bodyB == toggled; });
+        }
+        else
+        {
+            tree.insert(toggled - 7, MakeAABB(centers[toggled - 7].x, centers[toggled - 7].y, 8.f));
+            sap.SetProxy(toggled - 7, MakeAABB(centers[toggled - 7].x, centers[toggled - 7].y, 8.f), maskOf(toggled - 7));
+        }
+    }
+
+    // Later frames are coherent, only a fraction of the endpoints move
+    EXPECT_LT(sap.GetSwapCount(), centers.size() * 2);
+
+    std::vector<sas::BroadPair> pairs;
+    sap.GetPairs(pairs);
+    ASSERT_FALSE(pairs.empty());
+
+    uint32_t paired = pairs.front().bodyA;
+    sap.Remove(paired);
+
+    pairs.clear();
+    sap.GetPairs(pairs);
+    EXPECT_EQ(pairs.size(), sap.GetPairCount());
+    for (const auto &pair : pairs)
+    {
+        EXPECT_NE(pair.bodyA, paired);
+        EXPECT_NE(pair.bodyB, paired);
+    }
+}
+
+TEST(AABBTreeTest, MoveBufferOnlyHoldsChangedProxies)
+{
+    sas::AABBTree tree;
+
+    sas::Body body{};
+    body.shape = sas::Shape::MakeCircle(10.f);
+    body.transform.position = {100, 100};
+    body.bodyID = 3;
+
+    tree.insert(3, sas::ComputeFatAABB(body, 5.f));
+    ASSERT_EQ(tree.GetMoveBuffer().size(), 1);
+    EXPECT_EQ(tree.GetMoveBuffer()[0], 3);
+
+    tree.ClearMoveBuffer();
+
+    // Still inside the fat box
+    body.transform.position = {102, 100};
+    tree.UpdateObject(body, 5.f);
+    EXPECT_TRUE(tree.GetMoveBuffer().empty());
+
+    body.transform.position = {120, 100};
+    tree.UpdateObject(body, 5.f);
+    ASSERT_EQ(tree.GetMoveBuffer().size(), 1);
+    EXPECT_EQ(tree.GetMoveBuffer()[0], 3);
+}
+
+TEST(AABBTreeTest, QueryVisitStopsEarly)
+{
+    sas::AABBTree tree;
+
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        tree.insert(i, MakeAABB(static_cast<float>(i), 0, 5));
+    }
+
+    int visited = 0;
+    tree.QueryVisit(MakeAABB(32, 0, 100), [&visited](uint32_t)
+                    {
+                        ++visited;
+                        return visited < 3; });
+
+    EXPECT_EQ(visited, 3);
+
+    visited = 0;
+    tree.QueryVisit(MakeAABB(32, 0, 100), [&visited](uint32_t)
+                    { ++visited; });
+
+    EXPECT_EQ(visited, 64);
+}
+
+TEST(WideBVHTest, MatchesBinaryQueries)
+{
+    sas::AABBTree tree;
+    sas::WideBVH wide;
+
+    uint32_t seed = 4242;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    wide.Build(tree);
+    int visited = 0;
+    wide.QueryVisit(MakeAABB(0, 0, 1000), [&visited](uint32_t)
+                    { ++visited; });
+    EXPECT_EQ(visited, 0);
+
+    tree.insert(0, MakeAABB(0, 0, 1));
+    wide.Build(tree);
+    wide.QueryVisit(MakeAABB(0, 0, 1000), [&visited](uint32_t)
+                    { ++visited; });
+    EXPECT_EQ(visited, 1);
+
+    for (uint32_t i = 1; i < 700; ++i)
+    {
+        tree.insert(i, MakeAABB(next() * 1000.f, next() * 1000.f, 1.f + next() * 10.f));
+    }
+
+    wide.Build(tree);
+
+    for (int q = 0; q < 64; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 1000.f, next() * 1000.f, 40.f);
+
+        std::vector<uint32_t> a, b;
+        tree.Query(query, a);
+        wide.QueryVisit(query, [&b](uint32_t id)
+                        { b.push_back(id); });
+
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        EXPECT_EQ(a, b);
+    }
+}
+
+TEST(WideBVHTest, RefitFollowsMovedBodies)
+{
+    sas::AABBTree tree;
+    sas::WideBVH wide;
+
+    uint32_t seed = 777;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    const uint32_t layer2 = sas::Flags::Layer2 | (sas::Flags::Layer2 << 16);
+
+    for (uint32_t i = 0; i < 500; ++i)
+    {
+        tree.insert(i, MakeAABB(next() * 1000.f, next() * 1000.f, 2.f + next() * 8.f));
+    }
+
+    wide.Build(tree);
+    tree.ClearMoveBuffer();
+    EXPECT_EQ(wide.GetLeafCount(), 500u);
+
+    for (int frame = 0; frame < 10; ++frame)
+    {
+        // Some bodies jump across the scene, one changes layers, one leaves and its id comes back elsewhere
+        for (uint32_t i = 0; i < 500; i += 7)
+        {
+            sas::AABB box = MakeAABB(next() * 1000.f, next() * 1000.f, 2.f + next() * 8.f);
+            tree.UpdateObject(i, box, box);
+        }
+
+        uint32_t changed = static_cast<uint32_t>(frame) * 13 + 1;
+        tree.SetCollisionMask(changed, layer2);
+
+        uint32_t reused = static_cast<uint32_t>(frame) * 11 + 3;
+        tree.remove(reused);
+        tree.insert(reused, MakeAABB(next() * 1000.f, next() * 1000.f, 5.f));
+
+        uint32_t removed = 499 - static_cast<uint32_t>(frame);
+        tree.remove(removed);
+
+        ASSERT_TRUE(wide.Refit(tree, tree.GetMoveBuffer()));
+        tree.ClearMoveBuffer();
+
+        for (int q = 0; q < 32; ++q)
+        {
+            sas::AABB query = MakeAABB(next() * 1000.f, next() * 1000.f, 40.f);
+            uint32_t mask = q % 2 ? layer2 : sas::Flags::LayerAll | sas::Flags::MaskAll;
+
+            std::vector<uint32_t> a, b;
+            tree.QueryVisit(query, mask, [&a](uint32_t id)
+                            { a.push_back(id); });
+            wide.QueryVisit(query, mask, [&tree, &b](uint32_t id)
+                            {
+                                if (tree.Contains(id))
+                                    b.push_back(id); });
+
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            EXPECT_EQ(a, b) << "frame " << frame;
+        }
+    }
+
+    // A body the snapshot never had needs a Build
+    tree.insert(600, MakeAABB(0, 0, 5));
+    EXPECT_FALSE(wide.Refit(tree, tree.GetMoveBuffer()));
+}
+
+TEST(WideBVHTest, SkipsEmptyLanes)
+{
+    sas::AABBTree tree;
+    sas::WideBVH wide;
+
+    // Five leaves leave empty lanes behind in the wide nodes
+    for (uint32_t i = 0; i < 5; ++i)
+    {
+        tree.insert(i, MakeAABB(static_cast<float>(i) * 30.f, 0, 5));
+    }
+    wide.Build(tree);
+
+    const float lowest = std::numeric_limits<float>::lowest();
+    const float highest = std::numeric_limits<float>::max();
+
+    std::vector<uint32_t> found;
+    wide.QueryVisit({lowest, lowest, highest, highest}, [&found](uint32_t id)
+                    { found.push_back(id); });
+
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(found, (std::vector<uint32_t>{0, 1, 2, 3, 4}));
+}
+
+TEST(AABBTreeTest, BulkBuildMatchesIncrementalTree)
+{
+    sas::AABBTree built;
+    sas::AABBTree incremental;
+    std::vector<sas::TreeProxy> proxies;
+
+    uint32_t seed = 99;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (uint32_t i = 0; i < 2000; ++i)
+    {
+        proxies.emplace_back(i, MakeAABB(next() * 2000.f, next() * 2000.f, 1.f + next() * 10.f));
+        incremental.insert(i, proxies.back().second);
+    }
+
+    // Identical boxes must not break the binning
+    for (uint32_t i = 2000; i < 2050; ++i)
+    {
+        proxies.emplace_back(i, MakeAABB(500, 500, 3));
+        incremental.insert(i, proxies.back().second);
+    }
+
+    built.Build(proxies);
+
+    EXPECT_EQ(built.GetMoveBuffer().size(), proxies.size());
+    EXPECT_LE(built.GetHeight(), 30);
+
+    for (int q = 0; q < 64; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 2000.f, next() * 2000.f, 60.f);
+
+        std::vector<uint32_t> a, b;
+        built.Query(query, a);
+        incremental.Query(query, b);
+
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        EXPECT_EQ(a, b);
+    }
+
+    // A built tree keeps working incrementally
+    built.remove(2001);
+    built.insert(5000, MakeAABB(500, 500, 3));
+
+    std::vector<uint32_t> results;
+    built.Query(MakeAABB(500, 500, 1), results);
+    EXPECT_EQ(results.size(), 50);
+}
+
+TEST(AABBTreeTest, ParallelBuildMatchesBruteForce)
+{
+    std::vector<sas::TreeProxy> proxies;
+
+    uint32_t seed = 2024;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (uint32_t i = 0; i < 3000; ++i)
+    {
+        proxies.emplace_back(i * 2, MakeAABB(next() * 3000.f, next() * 3000.f, 1.f + next() * 10.f));
+    }
+
+    // Duplicate Morton codes
+    for (uint32_t i = 0; i < 40; ++i)
+    {
+        proxies.emplace_back(10000 + i, MakeAABB(1500, 1500, 2));
+    }
+
+    sas::AABBTree tree;
+    tree.BuildParallel(proxies, 4);
+
+    EXPECT_EQ(tree.GetMoveBuffer().size(), proxies.size());
+
+    for (int q = 0; q < 64; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 3000.f, next() * 3000.f, 80.f);
+        if (q == 0)
+            query = MakeAABB(1500, 1500, 1);
+
+        std::vector<uint32_t> found;
+        tree.Query(query, found);
+
+        std::vector<uint32_t> expected;
+        for (const auto &[id, aabb] : proxies)
+        {
+            if (sas::AABBOverlap(aabb, query))
+                expected.push_back(id);
+        }
+
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        EXPECT_EQ(found, expected);
+    }
+
+    // Incremental updates keep working on the built tree
+    tree.remove(10000);
+    tree.insert(1, MakeAABB(1500, 1500, 2));
+
+    std::vector<uint32_t> results;
+    tree.Query(MakeAABB(1500, 1500, 1), results);
+    EXPECT_EQ(results.size(), 40);
+}
+
+TEST(AABBTreeTest, QueryNearestMatchesBruteForce)
+{
+    sas::AABBTree tree;
+
+    uint32_t seed = 99;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    std::vector<sas::AABB> boxes;
+    for (uint32_t i = 0; i < 400; ++i)
+    {
+        boxes.push_back(MakeAABB(next() * 1000.f, next() * 1000.f, 1.f + next() * 4.f));
+        tree.insert(i, boxes.back());
+    }
+
+    for (int q = 0; q < 20; ++q)
+    {
+        sas::math::Vec2 point{next() * 1000.f, next() * 1000.f};
+
+        // Odd ids are filtered out
+        auto distance = [&](uint32_t id)
+        {
+            return id % 2 ? -1.f : std::sqrt(sas::PointAABBDistanceSq(point, boxes[id]));
+        };
+
+        std::vector<float> expected;
+        for (uint32_t i = 0; i < boxes.size(); i += 2)
+        {
+            expected.push_back(distance(i));
+        }
+        std::sort(expected.begin(), expected.end());
+
+        sas::NearestResult results[5];
+        size_t count = tree.QueryNearest(point, 1e9f, results, distance);
+
+        ASSERT_EQ(count, 5);
+        for (size_t i = 0; i < count; ++i)
+        {
+            EXPECT_EQ(results[i].bodyID % 2, 0);
+            EXPECT_FLOAT_EQ(results[i].distance, expected[i]);
+        }
+
+        // maxDist cuts the list short
+        count = tree.QueryNearest(point, (expected[2] + expected[3]) * 0.5f, results, distance);
+        EXPECT_EQ(count, 3);
+    }
+}
+
+TEST(AABBTreeTest, QueryBatchMatchesSingleQueries)
+{
+    sas::AABBTree tree;
+
+    uint32_t seed = 5;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (uint32_t i = 0; i < 300; ++i)
+    {
+        tree.insert(i, MakeAABB(next() * 500.f, next() * 500.f, 2.f + next() * 6.f));
+    }
+
+    // More than one group of 64, last one partial
+    std::vector<sas::AABB> queries;
+    for (int i = 0; i < 150; ++i)
+    {
+        queries.push_back(MakeAABB(next() * 500.f, next() * 500.f, 5.f + next() * 20.f));
+    }
+
+    std::vector<std::pair<size_t, uint32_t>> batched;
+    tree.QueryBatch(queries, [&batched](size_t query, uint32_t id)
+                    { batched.emplace_back(query, id); });
+
+    std::vector<std::pair<size_t, uint32_t>> single;
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+        tree.QueryVisit(queries[i], [&single, i](uint32_t id)
+                        { single.emplace_back(i, id); });
+    }
+
+    std::sort(batched.begin(), batched.end());
+    std::sort(single.begin(), single.end());
+
+    EXPECT_FALSE(single.empty());
+    EXPECT_EQ(batched, single);
+}
+
+TEST(AABBTreeTest, LayerMasksPruneQueriesAndPairs)
+{
+    constexpr uint32_t LayerA = sas::Flags::Layer1 | sas::Flags::Mask1;
+    constexpr uint32_t LayerB = sas::Flags::Layer2 | sas::Flags::Mask2;
+
+    uint32_t seed = 11;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    std::vector<sas::TreeProxy> proxies;
+    std::vector<uint32_t> masks;
+    for (uint32_t i = 0; i < 200; ++i)
+    {
+        proxies.emplace_back(i, MakeAABB(next() * 300.f, next() * 300.f, 3.f + next() * 8.f));
+        masks.push_back(i % 3 ? LayerA : LayerB);
+    }
+
+    auto expectedPairs = [&]()
+    {
+        std::vector<sas::BroadPair> expected;
+        for (uint32_t i = 0; i < proxies.size(); ++i)
+            for (uint32_t j = i + 1; j < proxies.size(); ++j)
+                if (sas::AABBOverlap(proxies[i].second, proxies[j].second) && sas::CanCollide(masks[i], masks[j]))
+                    expected.push_back({i, j});
+        return expected;
+    };
+
+    auto check = [&](const sas::AABBTree &tree)
+    {
+        std::vector<sas::BroadPair> pairs;
+        tree.FindAllPairs(pairs);
+        std::sort(pairs.begin(), pairs.end());
+        EXPECT_EQ(pairs, expectedPairs());
+
+        for (uint32_t i = 0; i < proxies.size(); ++i)
+        {
+            std::vector<uint32_t> found;
+            tree.QueryVisit(proxies[i].second, masks[i], [&found](uint32_t id)
+                            { found.push_back(id); });
+
+            for (uint32_t id : found)
+                EXPECT_TRUE(sas::CanCollide(masks[i], masks[id]));
+
+            size_t expected = 0;
+            for (uint32_t j = 0; j < proxies.size(); ++j)
+                expected += sas::AABBOverlap(proxies[i].second, proxies[j].second) && sas::CanCollide(masks[i], masks[j]);
+
+            EXPECT_EQ(found.size(), expected);
+        }
+    };
+
+    sas::AABBTree incremental;
+    sas::AABBTree built;
+    sas::AABBTree lbvh;
+    for (uint32_t i = 0; i < proxies.size(); ++i)
+    {
+        incremental.SetCollisionMask(i, masks[i]);
+        built.SetCollisionMask(i, masks[i]);
+        lbvh.SetCollisionMask(i, masks[i]);
+
+        incremental.insert(i, proxies[i].second);
+    }
+    built.Build(proxies);
+    lbvh.BuildParallel(proxies, 2);
+
+    check(incremental);
+    check(built);
+    check(lbvh);
+
+    // Moving bodies between layers refits the summaries above them
+    for (uint32_t i = 0; i < proxies.size(); i += 7)
+    {
+        masks[i] = masks[i] == LayerA ? LayerB : LayerA;
+
+        incremental.SetCollisionMask(i, masks[i]);
+        built.SetCollisionMask(i, masks[i]);
+    }
+
+    // And removals refit them too
+    for (uint32_t i = 1; i < proxies.size(); i += 5)
+    {
+        incremental.remove(i);
+        built.remove(i);
+        masks[i] = 0;
+    }
+
+    check(incremental);
+    check(built);
+}
+
+TEST(QuantizedBVHTest, NeverMissesAQueryHit)
+{
+    sas::AABBTree tree;
+    sas::QuantizedBVH quantized;
+
+    uint32_t seed = 77;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    tree.insert(0, MakeAABB(5, 5, 1));
+    quantized.Build(tree);
+
+    int visited = 0;
+    quantized.QueryVisit(MakeAABB(5, 5, 1), [&visited](uint32_t)
+                         { ++visited; });
+    EXPECT_EQ(visited, 1);
+
+    // Wide range of box sizes so deep nodes are tiny compared to the root
+    std::vector<sas::AABB> boxes{MakeAABB(5, 5, 1)};
+    for (uint32_t i = 1; i < 2000; ++i)
+    {
+        boxes.push_back(MakeAABB(next() * 100000.f, next() * 100000.f, 0.01f + next() * next() * 50.f));
+        tree.insert(i, boxes.back());
+    }
+
+    quantized.Build(tree);
+    EXPECT_LT(quantized.GetMemoryUsage(), tree.GetNodeCount() * sizeof(sas::Node));
+
+    size_t exact = 0, reported = 0;
+    for (int q = 0; q < 200; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 100000.f, next() * 100000.f, 1.f + next() * 500.f);
+
+        std::vector<uint32_t> a, b;
+        tree.Query(query, a);
+        quantized.QueryVisit(query, [&b](uint32_t id)
+                             { b.push_back(id); });
+
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        EXPECT_TRUE(std::includes(b.begin(), b.end(), a.begin(), a.end()));
+
+        exact += a.size();
+        reported += b.size();
+    }
+
+    // Conservative, but not by much
+    EXPECT_GT(exact, 0);
+    EXPECT_LE(reported, exact + exact / 10 + 5);
+
+    // Boxes that only touch a leaf's faces or corners, where a bound decoded a float step inside shows up
+    for (uint32_t i = 0; i < boxes.size(); ++i)
+    {
+        const sas::AABB &box = boxes[i];
+        const sas::AABB touching[] = {
+            {box.maxX, box.minY, box.maxX + 1.f, box.maxY},
+            {box.minX - 1.f, box.minY, box.minX, box.maxY},
+            {box.minX, box.maxY, box.maxX, box.maxY + 1.f},
+            {box.minX, box.minY - 1.f, box.maxX, box.minY},
+            {box.maxX, box.maxY, box.maxX + 1.f, box.maxY + 1.f},
+            {box.minX - 1.f, box.minY - 1.f, box.minX, box.minY},
+            {box.maxX, box.minY - 1.f, box.maxX + 1.f, box.minY},
+            {box.minX - 1.f, box.maxY, box.minX, box.maxY + 1.f},
+        };
+
+        for (const sas::AABB &query : touching)
+        {
+            bool found = false;
+            quantized.QueryVisit(query, [i, &found](uint32_t id)
+                                 {
+                                     found = found || id == i; });
+
+            EXPECT_TRUE(found) << "leaf " << i;
+        }
+    }
+}
+
+TEST(QuantizedBVHTest, PaddingCoversSmallMoves)
+{
+    sas::AABBTree tree;
+    sas::QuantizedBVH quantized;
+
+    uint32_t seed = 31;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    std::vector<sas::math::Vec2> centers;
+    for (uint32_t i = 0; i < 500; ++i)
+    {
+        centers.push_back({next() * 1000.f, next() * 1000.f});
+        tree.insert(i, MakeAABB(centers[i].x, centers[i].y, 5.f));
+    }
+
+    quantized.Build(tree, 4.f);
+    tree.ClearMoveBuffer();
+
+    // Moves under the padding, and a removed body, keep the snapshot
+    for (uint32_t i = 0; i < 500; i += 3)
+    {
+        sas::AABB box = MakeAABB(centers[i].x + (next() - 0.5f) * 7.f, centers[i].y + (next() - 0.5f) * 7.f, 5.f);
+        tree.UpdateObject(i, box, box);
+    }
+    tree.remove(250);
+
+    EXPECT_TRUE(quantized.Covers(tree, tree.GetMoveBuffer()));
+
+    for (int q = 0; q < 64; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 1000.f, next() * 1000.f, 40.f);
+
+        std::vector<uint32_t> a, b;
+        tree.Query(query, a);
+        quantized.QueryVisit(query, [&b](uint32_t id)
+                             { b.push_back(id); });
+
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        EXPECT_TRUE(std::includes(b.begin(), b.end(), a.begin(), a.end()));
+    }
+
+    tree.ClearMoveBuffer();
+
+    // Past the padding
+    sas::AABB far = MakeAABB(centers[7].x + 20.f, centers[7].y, 5.f);
+    tree.UpdateObject(7, far, far);
+    EXPECT_FALSE(quantized.Covers(tree, tree.GetMoveBuffer()));
+
+    // A body the snapshot never had
+    tree.ClearMoveBuffer();
+    tree.insert(600, MakeAABB(0, 0, 5));
+    EXPECT_FALSE(quantized.Covers(tree, tree.GetMoveBuffer()));
+
+    quantized.Build(tree, 4.f);
+    EXPECT_TRUE(quantized.Covers(tree, tree.GetMoveBuffer()));
+}
+
+TEST(AABBTreeTest, OptimizeLowersSAHCostAndKeepsQueries)
+{
+    // Greedy inserts in sorted order make a poor tree to start from
+    sas::AABBTree tree(sas::InsertStrategy::Greedy);
+
+    uint32_t seed = 3;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    std::vector<sas::AABB> boxes;
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        float x = static_cast<float>(i % 40) * 25.f + next() * 5.f;
+        float y = static_cast<float>(i / 40) * 25.f + next() * 5.f;
+
+        boxes.push_back(MakeAABB(x, y, 4.f + next() * 8.f));
+        tree.insert(i, boxes.back());
+    }
+    tree.ClearMoveBuffer();
+    tree.SetInsertStrategy(sas::InsertStrategy::BranchAndBound);
+
+    float before = tree.GetSAHCost();
+
+    for (int step = 0; step < 100; ++step)
+    {
+        tree.Optimize(16);
+    }
+
+    EXPECT_LT(tree.GetSAHCost(), before);
+    EXPECT_GT(tree.GetUpdateStats().optimized, 0);
+    EXPECT_LE(tree.GetMaxBalance(), 1);
+    EXPECT_TRUE(tree.GetMoveBuffer().empty());
+
+    for (int q = 0; q < 50; ++q)
+    {
+        sas::AABB query = MakeAABB(next() * 1000.f, next() * 625.f, 30.f);
+
+        std::vector<uint32_t> found;
+        tree.Query(query, found);
+        std::sort(found.begin(), found.end());
+
+        std::vector<uint32_t> expected;
+        for (uint32_t i = 0; i < boxes.size(); ++i)
+        {
+            if (sas::AABBOverlap(boxes[i], query))
+                expected.push_back(i);
+        }
+
+        EXPECT_EQ(found, expected);
+    }
+}
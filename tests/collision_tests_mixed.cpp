@@ -207,3 +207,73 @@ TEST_F(FixtureTest, MixedLayerTwoCollides)
 
     EXPECT_TRUE(bh1.IsColliding() && bh2.IsColliding());
 }
+
+TEST_F(FixtureTest, StaticBodiesOnlyPairWithDynamicOnes)
+{
+    world->settings.gravity = 0.f;
+
+    sas::Transform ground;
+    ground.position = {400, 300};
+    ground.rotation = 0.f;
+
+    // Two overlapping statics never produce a contact
+    sas::BodyHandle floor1 = world->CreateBody(sas::Shape::MakeBox(100, 8), ground, sas::Flags::Active | sas::Flags::Static);
+    ground.position = {450, 300};
+    sas::BodyHandle floor2 = world->CreateBody(sas::Shape::MakeBox(100, 8), ground, sas::Flags::Active | sas::Flags::Static);
+
+    EXPECT_TRUE(world->activeIDs.empty());
+
+    world->Step(0.01f);
+    EXPECT_TRUE(world->contacts.empty());
+
+    sas::Transform t;
+    t.position = {420, 285};
+
+    sas::BodyHandle ball = AddCircle(t, {});
+
+    world->Step(0.01f);
+
+    ASSERT_EQ(world->contacts.size(), 2);
+    EXPECT_TRUE(ball.IsColliding());
+    EXPECT_TRUE(floor1.IsColliding());
+    EXPECT_TRUE(floor2.IsColliding());
+
+    // Statics never get pushed around
+    EXPECT_EQ(floor1->transform.position.x, 400);
+    EXPECT_EQ(floor1->transform.position.y, 300);
+
+    world->RemoveBody(floor2);
+    world->Step(0.01f);
+
+    ASSERT_EQ(world->contacts.size(), 1);
+    EXPECT_TRUE(ball.IsColliding());
+}
+
+TEST_F(FixtureTest, ChangingLayerPairsRestingBodies)
+{
+    sas::Transform t1;
+    t1.position = {400, 200};
+    t1.rotation = 0.f;
+
+    sas::Transform t2;
+    t2.position = {410, 200};
+    t2.rotation = 0.f;
+
+    sas::BodyHandle circle = AddCircle(t1, {});
+    sas::BodyHandle box = AddBox(t2, {});
+
+    circle.SetCollision(sas::Flags::Layer2, sas::Flags::Mask2);
+    world->settings.gravity = 0.f;
+    world->Step(0.01f);
+
+    ASSERT_FALSE(circle.IsColliding());
+
+    // Neither body moves, only the layer change can bring the pair back
+    circle->kinematics.velocity = {0, 0};
+    box->kinematics.velocity = {0, 0};
+    circle.SetCollision(sas::Flags::Layer1, sas::Flags::Mask1);
+    world->Step(0.01f);
+
+    EXPECT_TRUE(circle.IsColliding());
+    EXPECT_TRUE(box.IsColliding());
+}
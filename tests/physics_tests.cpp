@@ -216,4 +216,329 @@ TEST_F(FixtureTest, ResetDoesNotCrashOrLeak)
 
     EXPECT_NO_FATAL_FAILURE();
 
-}
\ No newline at end of file
+}
+TEST_F(FixtureTest, RemovingPairedBodyDropsItsContacts)
+{
+    world->settings.gravity = 0.f;
+
+    sas::Transform t1;
+    t1.position = {400, 200};
+
+    sas::Transform t2;
+    t2.position = {410, 200};
+
+    sas::Transform t3;
+    t3.position = {100, 100};
+
+    sas::BodyHandle bh1 = AddCircle(t1, {});
+    sas::BodyHandle bh2 = AddCircle(t2, {});
+    AddCircle(t3, {});
+
+    world->Step(0.01f);
+    ASSERT_EQ(world->contacts.size(), 1);
+
+    world->RemoveBody(bh2);
+
+    // Recycles the removed id far away from bh1
+    AddCircle(t3, {});
+
+    world->Step(0.01f);
+    EXPECT_FALSE(bh1.IsColliding());
+
+    for (const auto &contact : world->contacts)
+    {
+        EXPECT_NE(contact.bodyA, bh1->bodyID);
+        EXPECT_NE(contact.bodyB, bh1->bodyID);
+    }
+}
+
+TEST_F(FixtureTest, WideBackendFindsSameContacts)
+{
+    sas::PhysicsWorld wideWorld({0, 0, WIDTH, HEIGHT}, sas::QueryBackend::Wide4);
+    sas::PhysicsWorld quantizedWorld({0, 0, WIDTH, HEIGHT}, sas::QueryBackend::Quantized);
+    wideWorld.settings.gravity = 0.f;
+    quantizedWorld.settings.gravity = 0.f;
+    world->settings.gravity = 0.f;
+
+    for (int i = 0; i < 20; ++i)
+    {
+        sas::Transform t;
+        t.position = {100.f + static_cast<float>(i) * 15.f, 200.f};
+
+        AddCircle(t, {});
+        wideWorld.CreateBody(sas::Shape::MakeCircle(10.f), t);
+        quantizedWorld.CreateBody(sas::Shape::MakeCircle(10.f), t);
+    }
+
+    world->Step(0.01f);
+    wideWorld.Step(0.01f);
+    quantizedWorld.Step(0.01f);
+
+    EXPECT_EQ(world->contacts.size(), 19);
+    EXPECT_EQ(wideWorld.contacts.size(), world->contacts.size());
+    EXPECT_EQ(quantizedWorld.contacts.size(), world->contacts.size());
+}
+
+TEST_F(FixtureTest, SnapshotBackendsFollowMovingBodies)
+{
+    sas::PhysicsWorld wideWorld({0, 0, WIDTH, HEIGHT}, sas::QueryBackend::Wide4);
+    sas::PhysicsWorld quantizedWorld({0, 0, WIDTH, HEIGHT}, sas::QueryBackend::Quantized);
+    wideWorld.settings.gravity = 0.f;
+    quantizedWorld.settings.gravity = 0.f;
+    world->settings.gravity = 0.f;
+
+    auto add = [this, &wideWorld, &quantizedWorld](float x, float y, sas::math::Vec2 velocity)
+    {
+        sas::Transform t;
+        t.position = {x, y};
+        t.rotation = 0.f;
+
+        sas::Kinematics k{};
+        k.velocity = velocity;
+
+        AddCircle(t, k);
+
+        for (sas::PhysicsWorld *other : {&wideWorld, &quantizedWorld})
+        {
+            sas::BodyHandle bh = other->CreateBody(sas::Shape::MakeCircle(10.f), t);
+            bh->kinematics = k;
+            bh->kinematics.inverseMass = 0.2f;
+        }
+    };
+
+    // Resting bodies apart from each other, with pairs of bullets flying into each other through their rows
+    for (int i = 0; i < 80; ++i)
+        add(60.f + static_cast<float>(i % 16) * 45.f, 60.f + static_cast<float>(i / 16) * 70.f, {});
+
+    for (int row = 0; row < 2; ++row)
+    {
+        float y = 95.f + static_cast<float>(row) * 140.f;
+        add(20.f, y, {300.f, 0.f});
+        add(780.f, y, {-300.f, 0.f});
+    }
+
+    for (int step = 0; step < 120; ++step)
+    {
+        // The snapshots keep the removed body, its id comes back with the new one
+        // Then everything gets pushed and the snapshots are built again
+        if (step == 20)
+        {
+            world->RemoveBody(40);
+            wideWorld.RemoveBody(40);
+            quantizedWorld.RemoveBody(40);
+        }
+        if (step == 40)
+            add(400.f, 400.f, {0.f, -200.f});
+        if (step == 70)
+        {
+            for (size_t i = 0; i < world->bodies.size(); ++i)
+            {
+                sas::math::Vec2 push{static_cast<float>(i % 7) * 20.f - 60.f, static_cast<float>(i % 5) * 20.f - 40.f};
+                world->bodies[i].kinematics.velocity = world->bodies[i].kinematics.velocity + push;
+                wideWorld.bodies[i].kinematics.velocity = wideWorld.bodies[i].kinematics.velocity + push;
+                quantizedWorld.bodies[i].kinematics.velocity = quantizedWorld.bodies[i].kinematics.velocity + push;
+            }
+        }
+
+        world->Step(0.016f);
+        wideWorld.Step(0.016f);
+        quantizedWorld.Step(0.016f);
+
+        ASSERT_EQ(wideWorld.contacts.size(), world->contacts.size()) << "step " << step;
+        ASSERT_EQ(quantizedWorld.contacts.size(), world->contacts.size()) << "step " << step;
+    }
+
+    for (size_t i = 0; i < world->bodies.size(); ++i)
+    {
+        EXPECT_EQ(wideWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(wideWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+        EXPECT_EQ(quantizedWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(quantizedWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+    }
+}
+
+TEST_F(FixtureTest, AlternativeBroadphasesMatchTree)
+{
+    sas::PhysicsWorld gridWorld({0, 0, WIDTH, HEIGHT});
+    gridWorld.settings.broadphase = sas::BroadphaseType::Grid;
+    gridWorld.settings.gridCellSize = 16.f;
+
+    sas::PhysicsWorld sapWorld({0, 0, WIDTH, HEIGHT});
+    sapWorld.settings.broadphase = sas::BroadphaseType::SweepAndPrune;
+
+    sas::PhysicsWorld hierarchicalWorld({0, 0, WIDTH, HEIGHT});
+    hierarchicalWorld.settings.broadphase = sas::BroadphaseType::HierarchicalGrid;
+
+    sas::Transform floor;
+    floor.position = {WIDTH / 2, HEIGHT - 50};
+    floor.rotation = 0.f;
+    world->CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+    gridWorld.CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+    sapWorld.CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+    hierarchicalWorld.CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+
+    // Falling pile, pairs come and go every Step
+    for (int i = 0; i < 40; ++i)
+    {
+        sas::Transform t;
+        t.position = {100.f + static_cast<float>(i % 10) * 18.f, 100.f + static_cast<float>(i / 10) * 25.f};
+        t.rotation = 0.f;
+
+        world->CreateBody(sas::Shape::MakeCircle(10.f), t);
+        gridWorld.CreateBody(sas::Shape::MakeCircle(10.f), t);
+        sapWorld.CreateBody(sas::Shape::MakeCircle(10.f), t);
+        hierarchicalWorld.CreateBody(sas::Shape::MakeCircle(10.f), t);
+    }
+
+    for (int step = 0; step < 60; ++step)
+    {
+        world->Step(0.016f);
+        gridWorld.Step(0.016f);
+        sapWorld.Step(0.016f);
+        hierarchicalWorld.Step(0.016f);
+
+        ASSERT_EQ(gridWorld.contacts.size(), world->contacts.size()) << "step " << step;
+        ASSERT_EQ(sapWorld.contacts.size(), world->contacts.size()) << "step " << step;
+        ASSERT_EQ(hierarchicalWorld.contacts.size(), world->contacts.size()) << "step " << step;
+    }
+
+    for (size_t i = 0; i < world->bodies.size(); ++i)
+    {
+        EXPECT_EQ(gridWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(gridWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+        EXPECT_EQ(sapWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(sapWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+        EXPECT_EQ(hierarchicalWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(hierarchicalWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+    }
+}
+
+TEST_F(FixtureTest, GridBroadphaseKeepsQueriesAndSwitchesBack)
+{
+    sas::PhysicsWorld gridWorld({0, 0, WIDTH, HEIGHT});
+    gridWorld.settings.broadphase = sas::BroadphaseType::Grid;
+    gridWorld.settings.gridCellSize = 16.f;
+
+    sas::PhysicsWorld sapWorld({0, 0, WIDTH, HEIGHT});
+    sapWorld.settings.broadphase = sas::BroadphaseType::SweepAndPrune;
+
+    sas::Transform floor;
+    floor.position = {WIDTH / 2, HEIGHT - 50};
+    floor.rotation = 0.f;
+    world->CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+    gridWorld.CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+    sapWorld.CreateBody(sas::Shape::MakeBox(WIDTH / 2, 10), floor, sas::Flags::Active | sas::Flags::Static);
+
+    for (int i = 0; i < 20; ++i)
+    {
+        sas::Transform t;
+        t.position = {100.f + static_cast<float>(i % 10) * 18.f, 100.f + static_cast<float>(i / 10) * 25.f};
+        t.rotation = 0.f;
+
+        AddCircle(t, {});
+        gridWorld.CreateBody(sas::Shape::MakeCircle(10.f), t)->kinematics.inverseMass = 0.2f;
+        sapWorld.CreateBody(sas::Shape::MakeCircle(10.f), t)->kinematics.inverseMass = 0.2f;
+    }
+
+    for (int step = 0; step < 80; ++step)
+    {
+        // Each broadphase takes over the boxes of the one before, the tree has to pick up their pairs
+        if (step == 20)
+        {
+            gridWorld.settings.broadphase = sas::BroadphaseType::SweepAndPrune;
+            sapWorld.settings.broadphase = sas::BroadphaseType::HierarchicalGrid;
+        }
+        if (step == 40)
+        {
+            gridWorld.settings.broadphase = sas::BroadphaseType::Tree;
+            sapWorld.settings.broadphase = sas::BroadphaseType::Tree;
+        }
+
+        world->Step(0.016f);
+        gridWorld.Step(0.016f);
+        sapWorld.Step(0.016f);
+
+        ASSERT_EQ(gridWorld.contacts.size(), world->contacts.size()) << "step " << step;
+        ASSERT_EQ(sapWorld.contacts.size(), world->contacts.size()) << "step " << step;
+
+        if (step != 30)
+            continue;
+
+        // The bodies fell since the dynamic tree last saw them
+        const sas::Body &body = gridWorld.bodies[1];
+        ASSERT_GT(body.transform.position.y, 140.f);
+
+        std::optional<uint32_t> picked = gridWorld.QueryPoint(body.transform.position);
+        ASSERT_TRUE(picked.has_value());
+        EXPECT_EQ(*picked, body.bodyID);
+
+        sas::RayHit hit = gridWorld.RayCast({{body.transform.position.x, 0.f}, {0.f, HEIGHT}});
+        ASSERT_TRUE(hit.hit);
+        EXPECT_EQ(hit.bodyID, body.bodyID);
+    }
+
+    for (size_t i = 0; i < world->bodies.size(); ++i)
+    {
+        EXPECT_EQ(gridWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(gridWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+        EXPECT_EQ(sapWorld.bodies[i].transform.position.x, world->bodies[i].transform.position.x);
+        EXPECT_EQ(sapWorld.bodies[i].transform.position.y, world->bodies[i].transform.position.y);
+    }
+}
+
+TEST_F(FixtureTest, CreateBodiesBuildsBroadphase)
+{
+    world->settings.gravity = 0.f;
+
+    sas::Transform t;
+    t.position = {100, 100};
+    AddCircle(t, {});
+
+    std::vector<sas::BodyDef> defs;
+    for (int i = 0; i < 10; ++i)
+    {
+        sas::BodyDef def{sas::Shape::MakeCircle(10.f), {}};
+        def.transform.position = {200.f + static_cast<float>(i) * 15.f, 200.f};
+        defs.push_back(def);
+    }
+
+    // Overlaps the body that already existed
+    sas::BodyDef last{sas::Shape::MakeCircle(10.f), {}};
+    last.transform.position = {110, 100};
+    defs.push_back(last);
+
+    std::vector<sas::BodyHandle> handles = world->CreateBodies(defs);
+    ASSERT_EQ(handles.size(), defs.size());
+    EXPECT_EQ(world->bodies.size(), 12);
+
+    world->Step(0.01f);
+
+    EXPECT_EQ(world->contacts.size(), 10);
+    EXPECT_TRUE(handles.back().IsColliding());
+}
+
+TEST_F(FixtureTest, BodyLandsOnStaticOfAnotherLayer)
+{
+    // Same layers as the demo, platforms on Layer2 and thrown bodies on Layer1
+    sas::Transform floor;
+    floor.position = {400, 300};
+    floor.rotation = 0.f;
+    sas::BodyHandle platform = world->CreateBody(sas::Shape::MakeBox(100, 8), floor, sas::Flags::Active | sas::Flags::Static);
+    platform.SetLayer(sas::Flags::Layer2);
+
+    sas::Transform t;
+    t.position = {400, 250};
+    t.rotation = 0.f;
+    sas::BodyHandle ball = AddCircle(t, {});
+    ball.SetCollision(sas::Flags::Layer1, sas::Flags::Mask1 | sas::Flags::Mask2);
+
+    bool landed = false;
+    for (int step = 0; step < 120; ++step)
+    {
+        world->Step(0.016f);
+        landed = landed || ball.IsColliding();
+    }
+
+    EXPECT_TRUE(landed);
+    EXPECT_LT(ball->transform.position.y, floor.position.y);
+}
@@ -0,0 +1,321 @@
+#include <gtest/gtest.h>
+#include "Fixture.hpp"
+
+TEST_F(FixtureTest, RayCastHitsClosestBody)
+{
+    sas::Transform near;
+    near.rotation = 0.f;
+    near.position = {200, 100};
+
+    sas::Transform far;
+    far.rotation = 0.f;
+    far.position = {400, 100};
+
+    AddCircle(far, {});
+    sas::BodyHandle first = AddCircle(near, {});
+
+    sas::RayHit hit = world->RayCast({{0, 100}, {600, 0}});
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, first.get()->bodyID);
+    EXPECT_NEAR(hit.point.x, 190.f, 1e-3f);
+    EXPECT_NEAR(hit.point.y, 100.f, 1e-3f);
+    EXPECT_NEAR(hit.normal.x, -1.f, 1e-3f);
+    EXPECT_NEAR(hit.fraction, 190.f / 600.f, 1e-5f);
+}
+
+TEST_F(FixtureTest, RayCastHitsRotatedBox)
+{
+    sas::Transform trans;
+    trans.position = {300, 200};
+    trans.rotation = 3.14159265f / 4.f;
+
+    sas::BodyHandle box = AddBox(trans, {});
+
+    sas::RayHit hit = world->RayCast({{100, 200}, {400, 0}});
+
+    // Corner of the diamond points at the ray
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, box.get()->bodyID);
+    EXPECT_NEAR(hit.point.x, 300.f - 10.f * std::sqrt(2.f), 1e-2f);
+    EXPECT_NEAR(hit.normal.lengthSq(), 1.f, 1e-4f);
+    EXPECT_LT(hit.normal.x, 0.f);
+}
+
+TEST_F(FixtureTest, RayCastMissesAndIgnoresContainingBody)
+{
+    sas::Transform trans;
+    trans.rotation = 0.f;
+    trans.position = {300, 200};
+
+    AddCircle(trans, {});
+
+    EXPECT_FALSE(world->RayCast({{0, 0}, {600, 0}}).hit);
+    EXPECT_FALSE(world->RayCast({{0, 200}, {250, 0}}).hit);
+    EXPECT_FALSE(world->RayCast({{300, 200}, {100, 0}}).hit);
+}
+
+TEST_F(FixtureTest, RayCastFiltersLayersAndSeesStatics)
+{
+    sas::Transform near;
+    near.rotation = 0.f;
+    near.position = {200, 100};
+
+    sas::Transform wall;
+    wall.rotation = 0.f;
+    wall.position = {400, 100};
+
+    sas::BodyHandle skipped = AddCircle(near, {});
+    skipped.SetCollision(sas::Flags::Layer2, sas::Flags::Mask2);
+
+    sas::BodyHandle ground = world->CreateBody(sas::Shape::MakeBox(10.f, 50.f), wall,
+                                               sas::Flags::Active | sas::Flags::Static);
+
+    sas::RayHit hit = world->RayCast({{0, 100}, {600, 0}}, sas::Flags::Layer1);
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, ground.get()->bodyID);
+    EXPECT_NEAR(hit.point.x, 390.f, 1e-3f);
+
+    hit = world->RayCast({{0, 100}, {600, 0}});
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, skipped.get()->bodyID);
+}
+
+TEST_F(FixtureTest, RayCastBatchMatchesSingleRays)
+{
+    uint32_t seed = 7;
+    auto next = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (int i = 0; i < 60; ++i)
+    {
+        sas::Transform trans;
+        trans.position = {next() * WIDTH, next() * HEIGHT};
+        trans.rotation = next() * 3.f;
+
+        if (i % 2)
+            AddCircle(trans, {});
+        else
+            AddBox(trans, {});
+    }
+
+    // Odd count so the last packet is partly empty, plus one axis aligned ray
+    std::vector<sas::Ray> rays;
+    for (int i = 0; i < 37; ++i)
+    {
+        rays.push_back({{next() * WIDTH, next() * HEIGHT}, {(next() - 0.5f) * 800.f, (next() - 0.5f) * 800.f}});
+    }
+    rays.push_back({{0, 200}, {800, 0}});
+
+    std::vector<sas::RayHit> hits(rays.size());
+    world->RayCastBatch(rays, hits);
+
+    int hitCount = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+        sas::RayHit single = world->RayCast(rays[i]);
+
+        ASSERT_EQ(hits[i].hit, single.hit) << "ray " << i;
+        if (single.hit)
+        {
+            ++hitCount;
+            EXPECT_EQ(hits[i].bodyID, single.bodyID);
+            EXPECT_FLOAT_EQ(hits[i].fraction, single.fraction);
+        }
+    }
+
+    EXPECT_GT(hitCount, 0);
+
+    // Fewer hit slots than rays only casts the rays that have one
+    std::vector<sas::RayHit> fewer(6);
+    world->RayCastBatch(rays, fewer);
+
+    for (size_t i = 0; i < fewer.size(); ++i)
+    {
+        ASSERT_EQ(fewer[i].hit, hits[i].hit) << "ray " << i;
+        if (hits[i].hit)
+        {
+            EXPECT_EQ(fewer[i].bodyID, hits[i].bodyID);
+        }
+    }
+}
+
+TEST_F(FixtureTest, ShapeCastCircleStopsAtBox)
+{
+    sas::Transform wall;
+    wall.position = {400, 200};
+    wall.rotation = 0.f;
+
+    sas::BodyHandle box = AddBox(wall, {});
+
+    sas::Transform start;
+    start.position = {100, 200};
+    start.rotation = 0.f;
+
+    sas::RayHit hit = world->ShapeCast(sas::Shape::MakeCircle(20.f), start, {500, 0});
+
+    // Circle touches the box face at x = 390 when its center reaches 370
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, box.get()->bodyID);
+    EXPECT_NEAR(hit.fraction, 270.f / 500.f, 1e-3f);
+    EXPECT_NEAR(hit.point.x, 390.f, 0.05f);
+    EXPECT_NEAR(hit.normal.x, -1.f, 1e-3f);
+
+    EXPECT_FALSE(world->ShapeCast(sas::Shape::MakeCircle(20.f), start, {200, 0}).hit);
+    EXPECT_FALSE(world->ShapeCast(sas::Shape::MakeCircle(20.f), start, {0, 200}).hit);
+}
+
+TEST_F(FixtureTest, ShapeCastRotatedBoxesHitCornerFirst)
+{
+    sas::Transform target;
+    target.position = {400, 200};
+    target.rotation = 3.14159265f / 4.f;
+
+    sas::BodyHandle diamond = AddBox(target, {});
+
+    sas::Transform start;
+    start.position = {100, 200};
+    start.rotation = 0.f;
+
+    sas::RayHit hit = world->ShapeCast(sas::Shape::MakeBox(10.f, 10.f), start, {600, 0});
+
+    // Corner of the diamond at 400 - 10 * sqrt(2) meets the caster's face at center + 10
+    float expected = (400.f - 10.f * std::sqrt(2.f) - 10.f - 100.f) / 600.f;
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, diamond.get()->bodyID);
+    EXPECT_NEAR(hit.fraction, expected, 1e-4f);
+}
+
+TEST_F(FixtureTest, ShapeCastReportsInitialOverlapAndClosestBody)
+{
+    sas::Transform near;
+    near.position = {200, 200};
+    near.rotation = 0.f;
+
+    sas::Transform far;
+    far.position = {300, 200};
+    far.rotation = 0.f;
+
+    AddCircle(far, {});
+    sas::BodyHandle first = AddCircle(near, {});
+
+    sas::Transform inside;
+    inside.position = {205, 200};
+    inside.rotation = 0.f;
+
+    sas::RayHit hit = world->ShapeCast(sas::Shape::MakeBox(5.f, 5.f), inside, {300, 0});
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, first.get()->bodyID);
+    EXPECT_EQ(hit.fraction, 0.f);
+
+    sas::Transform start;
+    start.position = {0, 205};
+    start.rotation = 0.f;
+
+    hit = world->ShapeCast(sas::Shape::MakeBox(5.f, 5.f), start, {400, 0});
+
+    ASSERT_TRUE(hit.hit);
+    EXPECT_EQ(hit.bodyID, first.get()->bodyID);
+    EXPECT_GT(hit.fraction, 0.f);
+}
+
+TEST_F(FixtureTest, ShapeCastGrazingApproachStillHits)
+{
+    // Far from the origin positions are too coarse to close within the tolerance,
+    // so some of these casts run out of iterations while still approaching
+    sas::Transform target;
+    target.position = {300000, 300000};
+    target.rotation = 0.f;
+
+    sas::BodyHandle circle = AddCircle(target, {});
+
+    sas::Transform start;
+    start.position = {0, 0};
+    start.rotation = 0.f;
+
+    for (int i = 0; i <= 80; ++i)
+    {
+        // Aiming up to 28 above the center passes it at up to 19.8, the radii sum to 20
+        float aim = 20.f + 0.1f * static_cast<float>(i);
+        sas::math::Vec2 translation{600000.f, 600000.f + 2.f * aim};
+
+        sas::RayHit hit = world->ShapeCast(sas::Shape::MakeCircle(10.f), start, translation);
+
+        double dx = translation.x, dy = translation.y;
+        double b = dx * 300000.0 + dy * 300000.0;
+        double c = 2.0 * 300000.0 * 300000.0 - 20.0 * 20.0;
+        double a = dx * dx + dy * dy;
+        double contact = (b - std::sqrt(b * b - a * c)) / a;
+
+        ASSERT_TRUE(hit.hit) << "aim " << aim;
+        EXPECT_EQ(hit.bodyID, circle.get()->bodyID);
+        EXPECT_LE(hit.fraction, contact + 1e-6) << "aim " << aim;
+        EXPECT_NEAR(hit.fraction, contact, 1e-5) << "aim " << aim;
+    }
+}
+
+TEST_F(FixtureTest, QueryNearestUsesShapeDistance)
+{
+    sas::Transform circlePos;
+    circlePos.position = {300, 200};
+    circlePos.rotation = 0.f;
+
+    // Box center is farther than the circle's, its face is not
+    sas::Transform boxPos;
+    boxPos.position = {105, 190};
+    boxPos.rotation = 0.f;
+
+    sas::Transform wallPos;
+    wallPos.position = {600, 200};
+    wallPos.rotation = 0.f;
+
+    sas::BodyHandle circle = AddCircle(circlePos, {});
+    sas::BodyHandle box = AddBox(boxPos, {});
+    sas::BodyHandle wall = world->CreateBody(sas::Shape::MakeBox(10.f, 100.f), wallPos,
+                                             sas::Flags::Active | sas::Flags::Static);
+
+    sas::NearestResult results[2];
+    size_t count = world->QueryNearest({200, 200}, results);
+
+    ASSERT_EQ(count, 2);
+    EXPECT_EQ(results[0].bodyID, box.get()->bodyID);
+    EXPECT_NEAR(results[0].distance, 85.f, 1e-3f);
+    EXPECT_EQ(results[1].bodyID, circle.get()->bodyID);
+    EXPECT_NEAR(results[1].distance, 90.f, 1e-3f);
+
+    count = world->QueryNearest({580, 250}, results, 50.f);
+
+    ASSERT_EQ(count, 1);
+    EXPECT_EQ(results[0].bodyID, wall.get()->bodyID);
+    EXPECT_NEAR(results[0].distance, 10.f, 1e-3f);
+}
+
+TEST_F(FixtureTest, QueryPointTestsExactShapes)
+{
+    sas::Transform circlePos;
+    circlePos.position = {200, 200};
+    circlePos.rotation = 0.f;
+
+    sas::Transform boxPos;
+    boxPos.position = {400, 200};
+    boxPos.rotation = 3.14159265f / 4.f;
+
+    sas::BodyHandle circle = AddCircle(circlePos, {});
+    sas::BodyHandle box = AddBox(boxPos, {});
+
+    EXPECT_EQ(world->QueryPoint({205, 205}), circle.get()->bodyID);
+    EXPECT_EQ(world->QueryPoint({413, 200}), box.get()->bodyID);
+
+    // Inside both bounding boxes, outside both shapes
+    EXPECT_FALSE(world->QueryPoint({209, 209}).has_value());
+    EXPECT_FALSE(world->QueryPoint({409, 209}).has_value());
+
+    EXPECT_FALSE(world->QueryPoint({205, 205}, sas::Flags::Layer2).has_value());
+}